@@ -0,0 +1,302 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+// Compares the cell size suggested by the cost model with the cell size
+// that is actually the fastest for each image of a corpus.
+// For every image and candidate cell size the benchmark builds a context,
+// then adds a sequence of scribbles, colorizing after each one of them,
+// the same way the example app does. Every size is measured with the cell
+// size as a constructor argument and fixed at compile time, picking the
+// instantiation with dispatch_cell_size as an app would after
+// suggest_cell_size.
+// 
+// Usage: cell_size_benchmark [-t threshold] [-e edits] image.pgm...
+// The images must be binary (P5) 8 bits PGM files with dark line art
+
+#include <lazybrush/grid_of_quadtrees_colorizer/colorizer.hpp>
+#include <lazybrush/grid_of_quadtrees_colorizer/cell_size.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+class disk_scribble;
+
+template <int cell_size_tp = lazybrush::grid_of_quadtrees_colorizer::dynamic_cell_size>
+using basic_colorization_context_type = lazybrush::grid_of_quadtrees_colorizer::colorization_context<disk_scribble, cell_size_tp>;
+using colorization_context_type = basic_colorization_context_type<>;
+using point_type = typename colorization_context_type::point_type;
+using rect_type = typename colorization_context_type::rect_type;
+using label_type = typename colorization_context_type::label_type;
+
+// Filled disk used as a synthetic scribble
+class disk_scribble
+{
+public:
+    disk_scribble(point_type const & center, int radius, label_type label)
+        : center_(center)
+        , radius_(radius)
+        , label_(label)
+    {}
+
+    std::vector<point_type>
+    contour_points() const
+    {
+        std::vector<point_type> points;
+        int const outer = radius_ * radius_;
+        int const inner = (radius_ - 1) * (radius_ - 1);
+        for (int y = -radius_; y <= radius_; ++y)
+        {
+            for (int x = -radius_; x <= radius_; ++x)
+            {
+                int const d = x * x + y * y;
+                if (d <= outer && d > inner)
+                {
+                    points.push_back(point_type(center_.x() + x, center_.y() + y));
+                }
+            }
+        }
+        return points;
+    }
+
+    bool
+    contains_point(point_type const & point) const
+    {
+        int const x = point.x() - center_.x();
+        int const y = point.y() - center_.y();
+        return x * x + y * y <= radius_ * radius_;
+    }
+
+    rect_type
+    rect() const
+    {
+        return rect_type(center_.x() - radius_, center_.y() - radius_, 2 * radius_ + 1, 2 * radius_ + 1);
+    }
+
+    label_type
+    label() const
+    {
+        return label_;
+    }
+
+private:
+    point_type center_;
+    int radius_;
+    label_type label_;
+};
+
+struct image
+{
+    int width{0};
+    int height{0};
+    std::vector<unsigned char> pixels;
+};
+
+static bool
+read_pgm(std::string const & file_name, image & result)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string magic;
+    file >> magic;
+    if (magic != "P5")
+    {
+        return false;
+    }
+
+    int values[3];
+    for (int & value : values)
+    {
+        file >> std::ws;
+        while (file.peek() == '#')
+        {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            file >> std::ws;
+        }
+        file >> value;
+    }
+    file.get();
+
+    if (!file || values[2] != 255)
+    {
+        return false;
+    }
+
+    result.width = values[0];
+    result.height = values[1];
+    result.pixels.resize(static_cast<std::size_t>(result.width) * result.height);
+    file.read(reinterpret_cast<char *>(result.pixels.data()), result.pixels.size());
+    return static_cast<bool>(file);
+}
+
+// Milliseconds spent building the context and doing "number_of_edits" edits.
+// The context has the cell size "cell_size_tp" fixed at compile time,
+// unless it is dynamic_cell_size
+template <int cell_size_tp>
+static double
+measure(image const & input_image, int cell_size, int threshold, int number_of_edits, int edit_size)
+{
+    using clock = std::chrono::steady_clock;
+    clock::time_point const start = clock::now();
+
+    basic_colorization_context_type<cell_size_tp> context
+    (
+        0,
+        0,
+        input_image.width,
+        input_image.height,
+        cell_size,
+        input_image.pixels.data(),
+        input_image.width,
+        threshold
+    );
+
+    std::mt19937 random_engine(1234);
+    for (int i = 0; i < number_of_edits; ++i)
+    {
+        point_type const center
+        (
+            static_cast<int>(random_engine() % input_image.width),
+            static_cast<int>(random_engine() % input_image.height)
+        );
+        context.append_scribble(disk_scribble(center, edit_size / 2, static_cast<label_type>(i % 3)));
+        lazybrush::grid_of_quadtrees_colorizer::colorize(context);
+    }
+
+    return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+}
+
+int
+main(int argc, char ** argv)
+{
+    int threshold = 128;
+    int number_of_edits = 8;
+    std::vector<std::string> file_names;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            threshold = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            number_of_edits = std::atoi(argv[++i]);
+        }
+        else
+        {
+            file_names.push_back(argv[i]);
+        }
+    }
+
+    if (file_names.empty())
+    {
+        std::fprintf(stderr, "usage: %s [-t threshold] [-e edits] image.pgm...\n", argv[0]);
+        return 1;
+    }
+
+    lazybrush::grid_of_quadtrees_colorizer::cell_size_cost_model const model;
+    int images = 0;
+    int hits = 0;
+    double total_suggested_time = 0.0;
+    double total_best_time = 0.0;
+
+    for (std::string const & file_name : file_names)
+    {
+        image input_image;
+        if (!read_pgm(file_name, input_image))
+        {
+            std::fprintf(stderr, "%s: not a binary 8 bits PGM file\n", file_name.c_str());
+            continue;
+        }
+
+        rect_type const rect(0, 0, input_image.width, input_image.height);
+        lazybrush::grid_of_quadtrees_colorizer::density_histogram histogram(rect);
+        histogram.add_points(input_image.pixels.data(), input_image.width, threshold);
+        std::vector<lazybrush::grid_of_quadtrees_colorizer::cell_size_estimate> const estimates =
+            histogram.estimate(model);
+        int const suggested_cell_size = histogram.suggest_cell_size(model);
+
+        std::printf("%s (%dx%d)\n", file_name.c_str(), input_image.width, input_image.height);
+        std::printf("    cell size   leaves (est.)   model cost   time (ms)   fixed (ms)\n");
+
+        int best_cell_size = 0;
+        double best_time = std::numeric_limits<double>::max();
+        double suggested_time = 0.0;
+        for (auto const & estimate : estimates)
+        {
+            using lazybrush::grid_of_quadtrees_colorizer::dynamic_cell_size;
+            double const time =
+                measure<dynamic_cell_size>(input_image, estimate.cell_size, threshold, number_of_edits, model.edit_size);
+            double const fixed_time =
+                lazybrush::grid_of_quadtrees_colorizer::dispatch_cell_size
+                (
+                    estimate.cell_size,
+                    [&](auto fixed_cell_size)
+                    {
+                        return measure<decltype(fixed_cell_size)::value>(input_image, estimate.cell_size, threshold, number_of_edits, model.edit_size);
+                    }
+                );
+            std::printf
+            (
+                "    %9d   %13lld   %10.0f   %9.1f   %10.1f%s\n",
+                estimate.cell_size,
+                estimate.leaves,
+                estimate.cost,
+                time,
+                fixed_time,
+                estimate.cell_size == suggested_cell_size ? "   <- suggested" : ""
+            );
+            if (time < best_time)
+            {
+                best_time = time;
+                best_cell_size = estimate.cell_size;
+            }
+            if (estimate.cell_size == suggested_cell_size)
+            {
+                suggested_time = time;
+            }
+        }
+
+        std::printf("    fastest: %d, suggested: %d (%.0f%% of the fastest time)\n\n",
+                    best_cell_size, suggested_cell_size, 100.0 * suggested_time / best_time);
+
+        ++images;
+        hits += best_cell_size == suggested_cell_size;
+        total_suggested_time += suggested_time;
+        total_best_time += best_time;
+    }
+
+    if (images > 0)
+    {
+        std::printf("%d images, suggested size was the fastest in %d, total time %.0f%% of the best possible\n",
+                    images, hits, 100.0 * total_suggested_time / total_best_time);
+    }
+
+    return 0;
+}
@@ -47,6 +47,8 @@ window::window()
     , selected_background_color_index_(-1)
     , use_implicit_scribble_(false)
     , show_scribbles_(true)
+    , show_stats_(false)
+    , prune_skeleton_(false)
 {
     setup_ui_();
 }
@@ -88,125 +90,107 @@ window::eventFilter(QObject *o, QEvent *e)
             else if (visualization_mode_ == visualization_mode_space_partitioning)
             {
                 grid_type const & working_grid = colorization_context_.working_grid();
-                working_grid.visit_leaves
-                (
-                    [&painter, &image_position, this](cell_type* cell) -> bool
+                for (cell_type * cell : working_grid.leaves())
+                {
+                    int c = static_cast<int>(std::log2(cell->size())) * 300 / static_cast<int>(std::log2(working_grid.cell_size()));
+                    if (cell->data().intensity == colorization_context_type::intensity_min)
                     {
-                        int c = static_cast<int>(std::log2(cell->size())) * 300 / static_cast<int>(std::log2(cell_size));
-                        if (cell->data().intensity == colorization_context_type::intensity_min)
-                        {
-                            painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), qRgb(0, 0, 0));
-                        }
-                        else
-                        {
-                            painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(c, 255, 255));
-                        }
-                        return true;
+                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), qRgb(0, 0, 0));
                     }
-                );
+                    else
+                    {
+                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(c, 255, 255));
+                    }
+                }
 
             }
             else if (visualization_mode_ == visualization_mode_space_partitioning_scribbles)
             {
                 grid_type const & working_grid = colorization_context_.working_grid();
 
-                working_grid.visit_leaves
-                (
-                    [&painter, &image_position, this](cell_type* cell) -> bool
+                for (cell_type * cell : working_grid.leaves())
+                {
+                    int h, s, v;
+                    if (cell->data().scribble_index == colorization_context_type::scribble_index_undefined)
                     {
-                        int h, s, v;
-                        if (cell->data().scribble_index == colorization_context_type::scribble_index_undefined)
-                        {
-                            h = 0;
-                            s = 0;
-                        }
-                        else
-                        {
-                            h = cell->data().scribble_index * 255 / scribbles_.size();
-                            s = 255;
-                        }
-                        v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(cell_size)) + 128;
-                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(h, s, v));
-                        return true;
+                        h = 0;
+                        s = 0;
                     }
-                );
+                    else
+                    {
+                        h = cell->data().scribble_index * 255 / scribbles_.size();
+                        s = 255;
+                    }
+                    v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(working_grid.cell_size())) + 128;
+                    painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(h, s, v));
+                }
 
             }
             else if (visualization_mode_ == visualization_mode_space_partitioning_labels)
             {
                 grid_type const & working_grid = colorization_context_.working_grid();
 
-                working_grid.visit_leaves
-                (
-                    [&painter, &image_position, this](cell_type* cell) -> bool
+                for (cell_type * cell : working_grid.leaves())
+                {
+                    QBrush b;
+                    if (cell->data().preferred_label == colorization_context_type::label_undefined)
                     {
-                        QBrush b;
-                        if (cell->data().preferred_label == colorization_context_type::label_undefined)
+                        int v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(working_grid.cell_size())) + 128;
+                        b = QBrush(QColor::fromHsv(0, 0, v));
+                    }
+                    else
+                    {
+                        int const index = cell->data().preferred_label;
+                        if (index == selected_background_color_index_)
                         {
-                            int v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(cell_size)) + 128;
-                            b = QBrush(QColor::fromHsv(0, 0, v));
+                            b = QBrush(QColor(the_palette[index][0], the_palette[index][1], the_palette[index][2]), Qt::FDiagPattern);
                         }
                         else
                         {
-                            int const index = cell->data().preferred_label;
-                            if (index == selected_background_color_index_)
-                            {
-                                b = QBrush(QColor(the_palette[index][0], the_palette[index][1], the_palette[index][2]), Qt::FDiagPattern);
-                            }
-                            else
+                            if (index >= 0 && index < 128)
                             {
-                                if (index >= 0 && index < 128)
-                                {
-                                    b = QBrush(QColor(the_palette[index][0], the_palette[index][1], the_palette[index][2]));
-                                }
+                                b = QBrush(QColor(the_palette[index][0], the_palette[index][1], the_palette[index][2]));
                             }
                         }
-                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), b);
-                        return true;
                     }
-                );
+                    painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), b);
+                }
 
             }
             else if (visualization_mode_ == visualization_mode_space_partitioning_neighbors)
             {
                 grid_type const & working_grid = colorization_context_.working_grid();
 
-                working_grid.visit_leaves
-                (
-                    [&painter, &image_position, this](cell_type* cell) -> bool
+                for (cell_type * cell : working_grid.leaves())
+                {
+                    int v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(working_grid.cell_size())) + 128;
+                    if (cell == selected_cell_)
                     {
-                        int v = static_cast<int>(std::log2(cell->size())) * 127 / static_cast<int>(std::log2(cell_size)) + 128;
-                        if (cell == selected_cell_)
+                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(0, 255, v));
+
+                        QPen pen(QColor(0, 0, 255));
+                        pen.setCosmetic(true);
+                        painter.setPen(pen);
+                        for (int side = lazybrush::grid_of_quadtrees_colorizer::top_side;
+                             side < lazybrush::grid_of_quadtrees_colorizer::number_of_sides;
+                             ++side)
                         {
-                            painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(0, 255, v));
-
-                            QPen pen(QColor(0, 0, 255));
-                            pen.setCosmetic(true);
-                            painter.setPen(pen);
-                            for (cell_type const * cell2 : cell->top_leaf_neighbors())
-                            {
-                                painter.drawLine(point_type_to_QPoint(cell->center()) + image_position, point_type_to_QPoint(cell2->center()) + image_position);
-                            }
-                            for (cell_type const * cell2 : cell->left_leaf_neighbors())
-                            {
-                                painter.drawLine(point_type_to_QPoint(cell->center()) + image_position, point_type_to_QPoint(cell2->center()) + image_position);
-                            }
-                            for (cell_type const * cell2 : cell->bottom_leaf_neighbors())
-                            {
-                                painter.drawLine(point_type_to_QPoint(cell->center()) + image_position, point_type_to_QPoint(cell2->center()) + image_position);
-                            }
-                            for (cell_type const * cell2 : cell->right_leaf_neighbors())
-                            {
-                                painter.drawLine(point_type_to_QPoint(cell->center()) + image_position, point_type_to_QPoint(cell2->center()) + image_position);
-                            }
-                        }
-                        else
-                        {
-                            painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(0, 0, v));
+                            working_grid.visit_leaf_neighbors
+                            (
+                                cell,
+                                static_cast<lazybrush::grid_of_quadtrees_colorizer::neighbor_side>(side),
+                                [&painter, &image_position, cell, this](cell_type const * cell2)
+                                {
+                                    painter.drawLine(point_type_to_QPoint(cell->center()) + image_position, point_type_to_QPoint(cell2->center()) + image_position);
+                                }
+                            );
                         }
-                        return true;
                     }
-                );
+                    else
+                    {
+                        painter.fillRect(QRectF(rect_type_to_QRect(cell->rect())).translated(image_position), QColor::fromHsv(0, 0, v));
+                    }
+                }
 
             }
             else if (visualization_mode_ == visualization_mode_labeling)
@@ -263,6 +247,11 @@ window::eventFilter(QObject *o, QEvent *e)
                 );
             }
 
+            if (show_stats_)
+            {
+                paint_stats_(painter);
+            }
+
             return true;
             
         }
@@ -584,6 +573,50 @@ window::colorize()
     }
 }
 
+void
+window::paint_stats_(QPainter & painter) const
+{
+    using lazybrush::grid_of_quadtrees_colorizer::grid_stats;
+
+    auto grid_stats_text =
+        [](QString const & name, grid_stats const & stats)
+        {
+            QString text =
+                QString("%1: %2 top level cells (%3 own), %4 nodes, %5 leaves, depth %6, %7 KiB (%8 KiB allocated)\n")
+                .arg(name)
+                .arg(stats.top_level_cells)
+                .arg(stats.own_top_level_cells)
+                .arg(stats.nodes)
+                .arg(stats.leaves)
+                .arg(stats.max_tree_depth)
+                .arg(stats.node_bytes / 1024)
+                .arg(stats.allocated_bytes / 1024);
+            for (std::size_t level = 0; level < stats.nodes_per_level.size(); ++level)
+            {
+                text += QString("    level %1: %2 nodes, %3 leaves\n")
+                        .arg(level)
+                        .arg(stats.nodes_per_level[level])
+                        .arg(stats.leaves_per_level[level]);
+            }
+            return text;
+        };
+
+    colorization_context_type::stats_type const stats = colorization_context_.stats();
+    QString const text =
+        grid_stats_text("Reference grid", stats.reference_grid) +
+        grid_stats_text("Working grid", stats.working_grid) +
+        QString("Scribbles: %1").arg(stats.scribbles);
+
+    painter.save();
+    painter.resetTransform();
+    QRect const text_rect =
+        painter.fontMetrics().boundingRect(widget_container_image_->rect(), Qt::AlignLeft | Qt::AlignTop, text);
+    painter.fillRect(text_rect.adjusted(0, 0, 20, 20), QColor(0, 0, 0, 160));
+    painter.setPen(Qt::white);
+    painter.drawText(text_rect.translated(10, 10), Qt::AlignLeft | Qt::AlignTop, text);
+    painter.restore();
+}
+
 QPoint
 window::point_type_to_QPoint(point_type const & point)
 {
@@ -22,6 +22,7 @@
 
 #include <lazybrush/grid_of_quadtrees_colorizer/colorization_context.hpp>
 
+class QPainter;
 class scribble;
 class colorizer_scribble;
 
@@ -31,9 +32,14 @@ using cell_type = typename colorization_context_type::working_grid_cell_type;
 using point_type = typename colorization_context_type::point_type;
 using rect_type = typename colorization_context_type::rect_type;
 
-constexpr int cell_size = 64;
 constexpr int palette_entry_size = 12;
 
+// The skeleton branches and components with less pixels are scan noise,
+// they are removed before building the grid when the skeleton is pruned
+// (see prune_skeleton)
+constexpr int minimum_branch_length = 8;
+constexpr int minimum_component_size = 16;
+
 extern const unsigned char the_palette[128][3];
 
 class window : public QWidget
@@ -91,6 +97,8 @@ private:
     int selected_background_color_index_;
     bool use_implicit_scribble_;
     bool show_scribbles_;
+    bool show_stats_;
+    bool prune_skeleton_;
 
     void
     setup_ui_();
@@ -103,6 +111,9 @@ private:
     void
     colorize();
 
+    void
+    paint_stats_(QPainter & painter) const;
+
     QPoint
     point_type_to_QPoint(point_type const & point);
     QRect
@@ -17,7 +17,6 @@
 
 #include "window.h"
 #include "scribble.hpp"
-#include "../preprocessing/threshold.hpp"
 #include "../preprocessing/skeleton.hpp"
 
 #include <QPushButton>
@@ -81,6 +80,10 @@ window::setup_ui_()
     check_box_use_implicit_scribble->setChecked(use_implicit_scribble_);
     QCheckBox * check_box_show_scribbles = new QCheckBox;
     check_box_show_scribbles->setChecked(show_scribbles_);
+    QCheckBox * check_box_show_stats = new QCheckBox;
+    check_box_show_stats->setChecked(show_stats_);
+    QCheckBox * check_box_prune_skeleton = new QCheckBox;
+    check_box_prune_skeleton->setChecked(prune_skeleton_);
 
     main_layout->setContentsMargins(0, 0, 0, 0);
     main_layout->setSpacing(0);
@@ -125,6 +128,8 @@ window::setup_ui_()
                 layout_other_options_contents->setSpacing(5);
                 layout_other_options_contents->addRow("Use Implicit Surrounding Background Scribble:", check_box_use_implicit_scribble);
                 layout_other_options_contents->addRow("Show Scribbles:", check_box_show_scribbles);
+                layout_other_options_contents->addRow("Show Statistics:", check_box_show_stats);
+                layout_other_options_contents->addRow("Prune Skeleton Of Opened Images:", check_box_prune_skeleton);
             layout_other_options->addLayout(layout_other_options_contents);
             
         tools_layout->addLayout(layout_io);
@@ -159,28 +164,41 @@ window::setup_ui_()
             }
 
             original_image_ = i.convertToFormat(QImage::Format_Grayscale8);
-            preprocessed_image_ =
-                preprocessing::skeleton_chen_hsu(preprocessing::threshold(original_image_, 192));
-
-            std::vector<colorization_context_type::input_point> image_points;
-            for (int y = 0; y < preprocessed_image_.height(); ++y)
+            preprocessed_image_ = QImage(original_image_.size(), QImage::Format_Grayscale8);
+
+            // Threshold and thin the line art in one stage, and optionally
+            // prune the spurs and specks of the skeleton. The grid is built
+            // from the packed skeleton, the preprocessed image is only
+            // written to show it
+            preprocessing::const_image_view const original_view
+            (
+                original_image_.constBits(),
+                original_image_.width(),
+                original_image_.height(),
+                original_image_.bytesPerLine()
+            );
+            preprocessing::image_view const preprocessed_view
+            (
+                preprocessed_image_.bits(),
+                preprocessed_image_.width(),
+                preprocessed_image_.height(),
+                preprocessed_image_.bytesPerLine()
+            );
+            preprocessing::skeleton_scratch scratch;
+            preprocessing::packed_bitmap_view skeleton =
+                preprocessing::skeleton_chen_hsu_bit_parallel(original_view, 192, scratch);
+            if (prune_skeleton_)
             {
-                quint8 * current_pixel = static_cast<quint8*>(preprocessed_image_.scanLine(y));
-                for (int x = 0; x < preprocessed_image_.width(); ++x, ++current_pixel)
-                {
-                    if (*current_pixel == 0)
-                    {
-                        image_points.push_back
-                        (
-                            colorization_context_type::input_point
-                            {
-                                point_type(x, y),
-                                colorization_context_type::intensity_min
-                            }
-                        );
-                    }
-                }
+                skeleton =
+                    preprocessing::prune_skeleton
+                    (
+                        skeleton,
+                        minimum_branch_length,
+                        minimum_component_size,
+                        scratch
+                    );
             }
+            preprocessing::unpack(skeleton, preprocessed_view);
 
             // original_image_ = i.convertToFormat(QImage::Format_Grayscale8);
             // preprocessed_image_ = QImage(i.width(), i.height(), QImage::Format_Grayscale8);
@@ -209,14 +227,10 @@ window::setup_ui_()
             colorization_context_ =
                 colorization_context_type
                 (
-                    0,
-                    0,
-                    preprocessed_image_.width(),
-                    preprocessed_image_.height(),
-                    cell_size,
-                    image_points
+                    rect_type(0, 0, skeleton.width(), skeleton.height()),
+                    lazybrush::grid_of_quadtrees_colorizer::automatic_cell_size,
+                    skeleton
                 );
-            colorization_context_.update_neighbors();
 
             scribbles_.clear();
 
@@ -316,4 +330,31 @@ window::setup_ui_()
             widget_container_image_->update();
         }
     );
+
+    connect
+    (
+        check_box_show_stats,
+        &QCheckBox::toggled,
+        [this](bool toggled)
+        {
+            if (toggled == show_stats_)
+            {
+                return;
+            }
+            show_stats_ = toggled;
+            widget_container_image_->update();
+        }
+    );
+
+    // The scribbles are drawn on the grid of the loaded image, so the
+    // option is used the next time an image is opened
+    connect
+    (
+        check_box_prune_skeleton,
+        &QCheckBox::toggled,
+        [this](bool toggled)
+        {
+            prune_skeleton_ = toggled;
+        }
+    );
 }
@@ -0,0 +1,99 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef IMAGE_VIEW_HPP
+#define IMAGE_VIEW_HPP
+
+#include <cstddef>
+#include <type_traits>
+
+namespace preprocessing
+{
+
+// 8 bits grayscale image in memory owned by someone else, with "stride"
+// bytes from the beginning of a row to the beginning of the next one
+template <typename pixel_type_tp>
+struct basic_image_view
+{
+    using pixel_type = pixel_type_tp;
+
+    basic_image_view() = default;
+    basic_image_view(basic_image_view const &) = default;
+    basic_image_view(basic_image_view &&) = default;
+    basic_image_view& operator=(basic_image_view const &) = default;
+    basic_image_view& operator=(basic_image_view &&) = default;
+
+    basic_image_view(pixel_type * data, int width, int height, int stride) :
+        data_(data),
+        width_(width),
+        height_(height),
+        stride_(stride)
+    {}
+
+    // A view of writable pixels can be used as a read only one
+    template
+    <
+        typename other_pixel_type_tp,
+        typename = std::enable_if_t<std::is_convertible<other_pixel_type_tp *, pixel_type *>::value>
+    >
+    basic_image_view(basic_image_view<other_pixel_type_tp> const & other) :
+        basic_image_view(other.data(), other.width(), other.height(), other.stride())
+    {}
+
+    pixel_type *
+    data() const
+    {
+        return data_;
+    }
+
+    int
+    width() const
+    {
+        return width_;
+    }
+
+    int
+    height() const
+    {
+        return height_;
+    }
+
+    int
+    stride() const
+    {
+        return stride_;
+    }
+
+    pixel_type *
+    row(int y) const
+    {
+        return data_ + static_cast<std::ptrdiff_t>(y) * stride_;
+    }
+
+private:
+    pixel_type * data_{nullptr};
+    int width_{0};
+    int height_{0};
+    int stride_{0};
+};
+
+using image_view = basic_image_view<unsigned char>;
+using const_image_view = basic_image_view<unsigned char const>;
+
+}
+
+#endif
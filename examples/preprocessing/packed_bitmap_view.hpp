@@ -0,0 +1,103 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PACKED_BITMAP_VIEW_HPP
+#define PACKED_BITMAP_VIEW_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace preprocessing
+{
+
+// Binary image packed with 64 pixels per word in memory owned by someone
+// else. The pixel "x" of a row is the bit "x % 64" of the word "x / 64",
+// 1 for black and 0 for white, and there are "stride" words from the
+// beginning of a row to the beginning of the next one.
+// It is a raster for the grids of lazybrush (see raster.hpp), whose points
+// are the black pixels with intensity 0, so a skeleton can be turned into
+// a colorization context without writing it to an 8 bits image first
+class packed_bitmap_view
+{
+public:
+    using word_type = std::uint64_t;
+
+    packed_bitmap_view() = default;
+    packed_bitmap_view(packed_bitmap_view const &) = default;
+    packed_bitmap_view(packed_bitmap_view &&) = default;
+    packed_bitmap_view& operator=(packed_bitmap_view const &) = default;
+    packed_bitmap_view& operator=(packed_bitmap_view &&) = default;
+
+    packed_bitmap_view(word_type const * data, int width, int height, int stride) :
+        data_(data),
+        width_(width),
+        height_(height),
+        stride_(stride)
+    {}
+
+    word_type const *
+    data() const
+    {
+        return data_;
+    }
+
+    int
+    width() const
+    {
+        return width_;
+    }
+
+    int
+    height() const
+    {
+        return height_;
+    }
+
+    int
+    stride() const
+    {
+        return stride_;
+    }
+
+    word_type const *
+    row(int y) const
+    {
+        return data_ + static_cast<std::ptrdiff_t>(y) * stride_;
+    }
+
+    bool
+    is_point(int x, int y) const
+    {
+        return (row(y)[x >> 6] >> (x & 63)) & 1;
+    }
+
+    unsigned char
+    value(int, int) const
+    {
+        return 0;
+    }
+
+private:
+    word_type const * data_{nullptr};
+    int width_{0};
+    int height_{0};
+    int stride_{0};
+};
+
+}
+
+#endif
@@ -18,26 +18,106 @@
 #ifndef SKELETON_HPP
 #define SKELETON_HPP
 
-#include <QImage>
+#include <cstdint>
+#include <vector>
+
+#include "image_view.hpp"
+#include "packed_bitmap_view.hpp"
 
 namespace preprocessing
 {
 
-// Input images to these algorithms are supposed to be 8 bits grayscale
+// Input images to these algorithms are supposed to be 8 bits grayscale.
+// The pixels with value 0 are the black ones that are thinned, and the
+// rest are white. The skeleton is written to "output" with the same values,
+// 0 for black and 255 for white. "output" must have the size of "input"
+// and can be "input" itself to compute the skeleton in place.
+// The memory the algorithms need is taken from "scratch". Passing the same
+// scratch to several calls reuses it instead of allocating it every time
+
+struct skeleton_scratch
+{
+    std::vector<unsigned char> pixels;
+    std::vector<std::uint64_t> words;
+    std::vector<int> candidates[2];
+    std::vector<int> removed_pixels;
+};
 
 // Thinning algorithm as explained in
 // "A Fast Parallel Algorithm for Thinning Digital Patterns"
 // by T. Y. ZHANG and C. Y. SUEN
-// inputImage is expected to be binary (0 = black, 255 = white)
-QImage
-skeleton_zhang_suen(QImage const & input_image);
+void
+skeleton_zhang_suen(const_image_view input, image_view output, skeleton_scratch & scratch);
 
 // Thinning algorithm as explained in
 // "A Modified Fast Parallel Algorithm for Thinning Digital Patterns"
 // by Y. S. CHEN and W. H. HSU
-// inputImage is expected to be binary (0 = black, 255 = white)
-QImage
-skeleton_chen_hsu(QImage const & input_image);
+void
+skeleton_chen_hsu(const_image_view input, image_view output, skeleton_scratch & scratch);
+
+// Same results as skeleton_zhang_suen and skeleton_chen_hsu, but the image
+// is packed with 64 pixels per word and the conditions are evaluated on
+// the 64 pixels of a word at once with bitwise operations
+void
+skeleton_zhang_suen_bit_parallel(const_image_view input, image_view output, skeleton_scratch & scratch);
+
+void
+skeleton_chen_hsu_bit_parallel(const_image_view input, image_view output, skeleton_scratch & scratch);
+
+// Threshold and thinning in one stage: the pixels of "input" with a value
+// lower than "v" are the black ones, and they are thresholded while the
+// image is packed. The skeleton is not unpacked, the returned bitmap points
+// to the scratch memory and is valid until the scratch is used again
+packed_bitmap_view
+skeleton_zhang_suen_bit_parallel(const_image_view input, int v, skeleton_scratch & scratch);
+
+packed_bitmap_view
+skeleton_chen_hsu_bit_parallel(const_image_view input, int v, skeleton_scratch & scratch);
+
+// Writes "bitmap" to "output", 0 for black and 255 for white.
+// Both images must have the same size
+void
+unpack(packed_bitmap_view bitmap, image_view output);
+
+// Same results as skeleton_zhang_suen and skeleton_chen_hsu, but only the
+// neighbors of the pixels removed by a subiteration are tested again, so
+// the time depends on the area of the strokes instead of on the size of
+// the image times the number of iterations
+void
+skeleton_zhang_suen_frontier(const_image_view input, image_view output, skeleton_scratch & scratch);
+
+void
+skeleton_chen_hsu_frontier(const_image_view input, image_view output, skeleton_scratch & scratch);
+
+// Removes the noise that thinning leaves from scanned line art: the
+// branches with less than "minimum_branch_length" pixels from an end point
+// to a junction, and the 8-connected components with less than
+// "minimum_component_size" pixels. Nothing that separates two regions of
+// the drawing is removed: the branch pixels that join strokes, the
+// components that enclose a region, like small circles, and the pixels
+// that reach the edge of the image are kept. A value of 0 disables each
+// of them.
+// "input" is a skeleton with the values described above
+void
+prune_skeleton
+(
+    const_image_view input,
+    image_view output,
+    int minimum_branch_length,
+    int minimum_component_size,
+    skeleton_scratch & scratch
+);
+
+// Same, but on a packed skeleton, which can be the one returned by the
+// bit-parallel thinning. The returned bitmap points to the scratch memory
+packed_bitmap_view
+prune_skeleton
+(
+    packed_bitmap_view skeleton,
+    int minimum_branch_length,
+    int minimum_component_size,
+    skeleton_scratch & scratch
+);
 
 }
 
@@ -0,0 +1,486 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "skeleton.hpp"
+#include "skeleton_image.hpp"
+#include "skeleton_lut.hpp"
+
+#include <lazybrush/parallel.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace preprocessing
+{
+
+// Below this number of words per thread, handing the bands to
+// the thread pool costs more than what it saves
+static constexpr int minimum_words_per_thread = 1 << 14;
+
+// Binary image with 64 pixels per word, 1 for the black pixels of the
+// input and 0 for the white ones. The pixel "x" of a row is the bit
+// "x % 64" of the word "x / 64". Every row has a zero word at each side,
+// and there is a zero row above and below the image, which is the same
+// as the 1 pixel border that the byte versions add.
+// The words are owned by the scratch memory and must be zero initialized
+class packed_image
+{
+public:
+    packed_image(word_type * words, int width, int height)
+        : width_(width)
+        , height_(height)
+        , words_per_row_(preprocessing::words_per_row(width))
+        , stride_(words_per_row_ + 2)
+        , words_(words)
+    {}
+
+    // Number of words of an image of the given size
+    static std::size_t
+    size(int width, int height)
+    {
+        return static_cast<std::size_t>(preprocessing::words_per_row(width) + 2) * (height + 2);
+    }
+
+    int
+    width() const
+    {
+        return width_;
+    }
+
+    int
+    height() const
+    {
+        return height_;
+    }
+
+    int
+    words_per_row() const
+    {
+        return words_per_row_;
+    }
+
+    // "y" can be -1 and "height()", and the words at -1 and
+    // "words_per_row()" can be read, all of them are 0
+    word_type *
+    row(int y)
+    {
+        return words_ + static_cast<std::size_t>(y + 1) * stride_ + 1;
+    }
+
+    word_type const *
+    row(int y) const
+    {
+        return words_ + static_cast<std::size_t>(y + 1) * stride_ + 1;
+    }
+
+    packed_bitmap_view
+    view() const
+    {
+        return packed_bitmap_view(row(0), width_, height_, stride_);
+    }
+
+    void
+    swap(packed_image & other)
+    {
+        std::swap(width_, other.width_);
+        std::swap(height_, other.height_);
+        std::swap(words_per_row_, other.words_per_row_);
+        std::swap(stride_, other.stride_);
+        std::swap(words_, other.words_);
+    }
+
+private:
+    int width_;
+    int height_;
+    int words_per_row_;
+    int stride_;
+    word_type * words_;
+};
+
+// The rows of the image are split in one band per thread
+static int
+number_of_threads(int words_per_row, int height)
+{
+    long long const words = static_cast<long long>(words_per_row) * height;
+    return static_cast<int>(std::min<long long>(lazybrush::default_number_of_threads(), std::max(1LL, words / minimum_words_per_thread)));
+}
+
+static int
+number_of_threads(packed_image const & image)
+{
+    return number_of_threads(image.words_per_row(), image.height());
+}
+
+// The pixels with a value lower than "v" are black. The byte versions
+// only take the pixels with value 0, which is "v" = 1
+static void
+pack(const_image_view input, packed_image & image, int v)
+{
+    lazybrush::parallel_for
+    (
+        0,
+        image.height(),
+        [input, &image, v](int first_row, int last_row)
+        {
+            for (int y = first_row; y < last_row; ++y)
+            {
+                pack_row
+                (
+                    input.row(y),
+                    image.width(),
+                    image.row(y),
+                    [v](unsigned char pixel) { return pixel < v; }
+                );
+            }
+        },
+        number_of_threads(image)
+    );
+}
+
+void
+unpack(packed_bitmap_view bitmap, image_view output)
+{
+    lazybrush::parallel_for
+    (
+        0,
+        bitmap.height(),
+        [bitmap, output](int first_row, int last_row)
+        {
+            for (int y = first_row; y < last_row; ++y)
+            {
+                unpack_row(bitmap.row(y), bitmap.width(), output.row(y), 0, 255);
+            }
+        },
+        number_of_threads(words_per_row(bitmap.width()), bitmap.height())
+    );
+}
+
+// The 8 neighbors of 64 consecutive pixels of a row, one word per
+// direction. They are numbered as in the byte versions, from the top one
+// clockwise: n = 0, ne = 1, e = 2, se = 3, s = 4, sw = 5, w = 6, nw = 7
+struct neighborhood
+{
+    word_type n;
+    word_type ne;
+    word_type e;
+    word_type se;
+    word_type s;
+    word_type sw;
+    word_type w;
+    word_type nw;
+};
+
+// The pixels to the right and to the left of the ones of "row[0]"
+static word_type
+east(word_type const * row)
+{
+    return (row[0] >> 1) | (row[1] << (bits_per_word - 1));
+}
+
+static word_type
+west(word_type const * row)
+{
+    return (row[0] << 1) | (row[-1] >> (bits_per_word - 1));
+}
+
+static neighborhood
+make_neighborhood(word_type const * top, word_type const * middle, word_type const * bottom)
+{
+    return neighborhood{*top, east(top), east(middle), east(bottom), *bottom, west(bottom), west(middle), west(top)};
+}
+
+// Binary counters, computed on all the bits of the words at once
+static constexpr void
+half_add(word_type a, word_type b, word_type & sum, word_type & carry)
+{
+    sum = a ^ b;
+    carry = a & b;
+}
+
+static constexpr void
+full_add(word_type a, word_type b, word_type c, word_type & sum, word_type & carry)
+{
+    word_type const t = a ^ b;
+    sum = t ^ c;
+    carry = (a & b) | (t & c);
+}
+
+// Bits of the number of black neighbors, from 0 to 8
+struct neighbor_count
+{
+    word_type bit_0;
+    word_type bit_1;
+    word_type bit_2;
+    word_type bit_3;
+};
+
+static constexpr neighbor_count
+count_neighbors(neighborhood const & p)
+{
+    word_type s0 = 0, c0 = 0, s1 = 0, c1 = 0, s2 = 0, c2 = 0, c3 = 0, s4 = 0, c4 = 0, c5 = 0;
+    neighbor_count count{};
+    full_add(p.n, p.ne, p.e, s0, c0);
+    full_add(p.se, p.s, p.sw, s1, c1);
+    half_add(p.w, p.nw, s2, c2);
+    full_add(s0, s1, s2, count.bit_0, c3);
+    full_add(c0, c1, c2, s4, c4);
+    half_add(s4, c3, count.bit_1, c5);
+    half_add(c4, c5, count.bit_2, count.bit_3);
+    return count;
+}
+
+// Pixels with exactly one and exactly two 0 to 1 transitions in the
+// sequence of neighbors n, ne, e, se, s, sw, w, nw, n
+struct transition_count
+{
+    word_type one;
+    word_type two;
+};
+
+static constexpr transition_count
+count_transitions(neighborhood const & p)
+{
+    word_type const transitions[8] =
+    {
+        ~p.n & p.ne, ~p.ne & p.e, ~p.e & p.se, ~p.se & p.s,
+        ~p.s & p.sw, ~p.sw & p.w, ~p.w & p.nw, ~p.nw & p.n
+    };
+    // At most 4 transitions are possible, so saturating at 3 is enough
+    word_type at_least_one = 0;
+    word_type at_least_two = 0;
+    word_type at_least_three = 0;
+    for (word_type transition : transitions)
+    {
+        at_least_three |= at_least_two & transition;
+        at_least_two |= at_least_one & transition;
+        at_least_one |= transition;
+    }
+    return transition_count{at_least_one & ~at_least_two, at_least_two & ~at_least_three};
+}
+
+// condition_5 of the Chen-Hsu byte version
+static constexpr word_type
+chen_hsu_condition_5(word_type a, word_type b, word_type c, word_type d, word_type e)
+{
+    return a & b & ~c & ~d & ~e;
+}
+
+// The deletion rules return the pixels that the subiteration removes if
+// they are black. They are the conditions of skeleton_lut.hpp written
+// with bitwise operations, which is checked at compile time below
+struct zhang_suen_rule_1
+{
+    constexpr word_type
+    operator()(neighborhood const & p) const
+    {
+        neighbor_count const count = count_neighbors(p);
+        // 2 <= number of neighbors <= 6
+        word_type const condition_1 = (count.bit_1 | count.bit_2) & ~count.bit_3 & ~(count.bit_2 & count.bit_1 & count.bit_0);
+        return condition_1 & count_transitions(p).one & ~(p.n & p.e & p.s) & ~(p.e & p.s & p.w);
+    }
+};
+
+struct zhang_suen_rule_2
+{
+    constexpr word_type
+    operator()(neighborhood const & p) const
+    {
+        neighbor_count const count = count_neighbors(p);
+        word_type const condition_1 = (count.bit_1 | count.bit_2) & ~count.bit_3 & ~(count.bit_2 & count.bit_1 & count.bit_0);
+        return condition_1 & count_transitions(p).one & ~(p.n & p.e & p.w) & ~(p.n & p.s & p.w);
+    }
+};
+
+struct chen_hsu_rule_1
+{
+    constexpr word_type
+    operator()(neighborhood const & p) const
+    {
+        neighbor_count const count = count_neighbors(p);
+        transition_count const transitions = count_transitions(p);
+        // 2 <= number of neighbors <= 7
+        word_type const condition_1 = (count.bit_1 | count.bit_2) & ~count.bit_3;
+        return
+            (condition_1 & transitions.one & ~(p.n & p.e & p.s) & ~(p.e & p.s & p.w)) |
+            (transitions.two & chen_hsu_condition_5(p.n, p.e, p.s, p.sw, p.w)) |
+            chen_hsu_condition_5(p.e, p.s, p.n, p.w, p.nw);
+    }
+};
+
+struct chen_hsu_rule_2
+{
+    constexpr word_type
+    operator()(neighborhood const & p) const
+    {
+        neighbor_count const count = count_neighbors(p);
+        transition_count const transitions = count_transitions(p);
+        word_type const condition_1 = (count.bit_1 | count.bit_2) & ~count.bit_3;
+        return
+            (condition_1 & transitions.one & ~(p.n & p.e & p.w) & ~(p.n & p.s & p.w)) |
+            (transitions.two & chen_hsu_condition_5(p.n, p.w, p.e, p.se, p.s)) |
+            chen_hsu_condition_5(p.s, p.w, p.n, p.ne, p.e);
+    }
+};
+
+// True if "rule" removes a pixel for the same neighborhoods as "lut",
+// evaluating the rule on words with only their first bit used
+template <typename rule_type_tp>
+static constexpr bool
+matches_lut(rule_type_tp rule, thinning_lut const & lut)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        neighborhood const p
+        {
+            static_cast<word_type>(neighbor(i, 0)), static_cast<word_type>(neighbor(i, 1)),
+            static_cast<word_type>(neighbor(i, 2)), static_cast<word_type>(neighbor(i, 3)),
+            static_cast<word_type>(neighbor(i, 4)), static_cast<word_type>(neighbor(i, 5)),
+            static_cast<word_type>(neighbor(i, 6)), static_cast<word_type>(neighbor(i, 7))
+        };
+        if (((rule(p) & 1) != 0) != lut[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(matches_lut(zhang_suen_rule_1(), zhang_suen_lut_1), "zhang_suen_rule_1 does not match its table");
+static_assert(matches_lut(zhang_suen_rule_2(), zhang_suen_lut_2), "zhang_suen_rule_2 does not match its table");
+static_assert(matches_lut(chen_hsu_rule_1(), chen_hsu_lut_1), "chen_hsu_rule_1 does not match its table");
+static_assert(matches_lut(chen_hsu_rule_2(), chen_hsu_lut_2), "chen_hsu_rule_2 does not match its table");
+
+// Band of rows [first_row, last_row) of a subiteration, see below
+template <typename rule_type_tp>
+static bool
+subiteration(packed_image const & image, packed_image & result, rule_type_tp rule, int first_row, int last_row)
+{
+    word_type removed = 0;
+    for (int y = first_row; y < last_row; ++y)
+    {
+        word_type const * top = image.row(y - 1);
+        word_type const * middle = image.row(y);
+        word_type const * bottom = image.row(y + 1);
+        word_type * current_word = result.row(y);
+        for (int i = 0; i < image.words_per_row(); ++i, ++current_word)
+        {
+            // Most of the words of line art are white
+            if (middle[i] == 0)
+            {
+                *current_word = 0;
+                continue;
+            }
+            word_type const pixels_to_remove = middle[i] & rule(make_neighborhood(top + i, middle + i, bottom + i));
+            *current_word = middle[i] & ~pixels_to_remove;
+            removed |= pixels_to_remove;
+        }
+    }
+    return removed != 0;
+}
+
+// Writes in "result" the pixels of "image" that the rule does not remove.
+// All the pixels are tested against "image", so the removed ones do not
+// affect the rest, as with the second bit of the byte versions.
+// That also makes the subiteration data parallel: the rows are split in
+// bands, and each thread only reads the row above and below its band
+// from "image" and writes its own rows of "result". The bands are tasks
+// of one job of lazybrush::thread_pool, whose workers live across the
+// subiterations, and the end of the job is the barrier between them.
+// Returns true if any pixel was removed
+template <typename rule_type_tp>
+static bool
+subiteration(packed_image const & image, packed_image & result, rule_type_tp rule)
+{
+    std::atomic<bool> removed_any{false};
+    lazybrush::parallel_for
+    (
+        0,
+        image.height(),
+        [&image, &result, rule, &removed_any](int first_row, int last_row)
+        {
+            if (subiteration(image, result, rule, first_row, last_row))
+            {
+                removed_any.store(true, std::memory_order_relaxed);
+            }
+        },
+        number_of_threads(image)
+    );
+    return removed_any.load(std::memory_order_relaxed);
+}
+
+// The skeleton is left in the scratch memory
+template <typename rule_1_type_tp, typename rule_2_type_tp>
+static packed_bitmap_view
+skeleton_bit_parallel
+(
+    const_image_view input,
+    int v,
+    skeleton_scratch & scratch,
+    rule_1_type_tp rule_1,
+    rule_2_type_tp rule_2
+)
+{
+    std::size_t const image_size = packed_image::size(input.width(), input.height());
+    scratch.words.assign(2 * image_size, 0);
+    packed_image image(scratch.words.data(), input.width(), input.height());
+    packed_image result(scratch.words.data() + image_size, input.width(), input.height());
+    pack(input, image, v);
+
+    while (true)
+    {
+        bool const removed_1 = subiteration(image, result, rule_1);
+        image.swap(result);
+
+        bool const removed_2 = subiteration(image, result, rule_2);
+        image.swap(result);
+
+        if (!removed_1 && !removed_2)
+        {
+            break;
+        }
+    }
+
+    return image.view();
+}
+
+void
+skeleton_zhang_suen_bit_parallel(const_image_view input, image_view output, skeleton_scratch & scratch)
+{
+    unpack(skeleton_bit_parallel(input, 1, scratch, zhang_suen_rule_1(), zhang_suen_rule_2()), output);
+}
+
+void
+skeleton_chen_hsu_bit_parallel(const_image_view input, image_view output, skeleton_scratch & scratch)
+{
+    unpack(skeleton_bit_parallel(input, 1, scratch, chen_hsu_rule_1(), chen_hsu_rule_2()), output);
+}
+
+packed_bitmap_view
+skeleton_zhang_suen_bit_parallel(const_image_view input, int v, skeleton_scratch & scratch)
+{
+    return skeleton_bit_parallel(input, v, scratch, zhang_suen_rule_1(), zhang_suen_rule_2());
+}
+
+packed_bitmap_view
+skeleton_chen_hsu_bit_parallel(const_image_view input, int v, skeleton_scratch & scratch)
+{
+    return skeleton_bit_parallel(input, v, scratch, chen_hsu_rule_1(), chen_hsu_rule_2());
+}
+
+}
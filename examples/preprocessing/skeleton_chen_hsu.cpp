@@ -16,127 +16,67 @@
 // along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "skeleton.hpp"
+#include "skeleton_lut.hpp"
+
+#include <cstddef>
 
 namespace preprocessing
 {
 
-// Add a 1 pixel border and
-// copy the inputImage changing white values (255) to 0 and
-// black values (0) to 1
-static QImage
-preprocess(QImage const & input_image)
+// Copy the input image to the scratch memory adding a 1 pixel border
+// and changing white values (255) to 0 and black values (0) to 1
+static image_view
+preprocess(const_image_view input, skeleton_scratch & scratch)
 {
-    QImage image = input_image.copy(-1, -1, input_image.width() + 2, input_image.height() + 2);
+    int const stride = input.width() + 2;
+    scratch.pixels.assign(static_cast<std::size_t>(stride) * (input.height() + 2), 0);
+    image_view const image(scratch.pixels.data(), input.width() + 2, input.height() + 2, stride);
     for (int y = 1; y < image.height() - 1; ++y)
     {
-        quint8 * current_pixel = static_cast<quint8 *>(image.scanLine(y) + 1);
-        for (int x = 1; x < image.width() - 1; ++x, ++current_pixel)
+        unsigned char const * input_pixel = input.row(y - 1);
+        unsigned char * current_pixel = image.row(y) + 1;
+        for (int x = 1; x < image.width() - 1; ++x, ++input_pixel, ++current_pixel)
         {
-            *current_pixel = (255 - *current_pixel) / 255;
+            *current_pixel = (255 - *input_pixel) / 255;
         }
     }
     return image;
 }
 
-// Remove the 1 pixel border and
-// copy the inputImage changing 0 values to white (255) and
-// 1 values to black (0)
-static QImage
-postprocess(QImage const & input_image)
-{
-    QImage image = input_image.copy(1, 1, input_image.width() - 2, input_image.height() - 2);
-    for (int y = 0; y < image.height(); ++y)
-    {
-        quint8 * current_pixel = static_cast<quint8 *>(image.scanLine(y));
-        for (int x = 0; x < image.width(); ++x, ++current_pixel)
-        {
-            *current_pixel = (1 - *current_pixel) * 255;
-        }
-    }
-    return image;
-}
-
-static bool
-condition_1(quint8 const * neighbors)
-{
-    const int n = neighbors[0] + neighbors[1] + neighbors[2] + neighbors[3] +
-                  neighbors[4] + neighbors[5] + neighbors[6] + neighbors[7];
-    return n >= 2 && n <= 7;
-}
-
-static int
-zero_one_turns(quint8 const * neighbors)
+// Copy the image without the 1 pixel border to the output image
+// changing 0 values to white (255) and 1 values to black (0)
+static void
+postprocess(image_view image, image_view output)
 {
-    int n = 0;
-    for (int i = 0; i < 7; ++i)
+    for (int y = 1; y < image.height() - 1; ++y)
     {
-        if (neighbors[i] == 0 && neighbors[i + 1] == 1)
+        unsigned char const * current_pixel = image.row(y) + 1;
+        unsigned char * output_pixel = output.row(y - 1);
+        for (int x = 1; x < image.width() - 1; ++x, ++current_pixel, ++output_pixel)
         {
-            ++n;
+            *output_pixel = (1 - *current_pixel) * 255;
         }
     }
-    if (neighbors[7] == 0 && neighbors[0] == 1)
-    {
-        ++n;
-    }
-    return n;
-}
-
-static bool
-condition_2(quint8 const * neighbors)
-{
-    return zero_one_turns(neighbors) == 1;
-}
-
-static bool
-condition_3(int a, int b, int c)
-{
-    const int n = a * b * c;
-    return n == 0;
-}
-
-static bool
-condition_4(quint8 const * neighbors)
-{
-    return zero_one_turns(neighbors) == 2;
-}
-
-static bool
-condition_5(int a, int b, int c, int d, int e)
-{
-    const int n = a * b;
-    const int n2 = c + d + e;
-    return n == 1 && n2 == 0;
 }
 
 // Since the image only uses values 0 and 1, we use the
 // second bit to store if the pixel must be removed
 static int
-subiteration(QImage & input_image, quint8 const * lut, int const sub_iteration_number)
+subiteration(image_view image, thinning_lut const & lut)
 {
     int n = 0;
 
-    for (int y = 1; y < input_image.height() - 1; ++y)
+    for (int y = 1; y < image.height() - 1; ++y)
     {
-        quint8 * current_pixel = static_cast<quint8 *>(input_image.scanLine(y) + 1);
-        for (int x = 1; x < input_image.width() - 1; ++x, ++current_pixel)
+        unsigned char * current_pixel = image.row(y) + 1;
+        for (int x = 1; x < image.width() - 1; ++x, ++current_pixel)
         {
             if (*current_pixel == 0)
             {
                 continue;
             }
 
-            quint8 index = 0;
-            index |= (*(current_pixel - input_image.bytesPerLine()) & 1) << 0;
-            index |= (*(current_pixel - input_image.bytesPerLine() + 1) & 1) << 1;
-            index |= (*(current_pixel + 1) & 1) << 2;
-            index |= (*(current_pixel + input_image.bytesPerLine() + 1) & 1) << 3;
-            index |= (*(current_pixel + input_image.bytesPerLine()) & 1) << 4;
-            index |= (*(current_pixel + input_image.bytesPerLine() - 1) & 1) << 5;
-            index |= (*(current_pixel - 1) & 1) << 6;
-            index |= (*(current_pixel - input_image.bytesPerLine() - 1) & 1) << 7;
-
-            if (lut[index] & sub_iteration_number)
+            if (lut[pack_neighbors(current_pixel, image.stride())])
             {
                 *current_pixel |= 2;
                 ++n;
@@ -148,83 +88,32 @@ subiteration(QImage & input_image, quint8 const * lut, int const sub_iteration_n
 
 // If the second bit is set to 1, set the pixel to 0
 static void
-remove_pixels(QImage & input_image)
+remove_pixels(image_view image)
 {
-    for (int y = 1; y < input_image.height() - 1; ++y)
+    for (int y = 1; y < image.height() - 1; ++y)
     {
-        quint8 * current_pixel = static_cast<quint8 *>(input_image.scanLine(y) + 1);
-        for (int x = 1; x < input_image.width() - 1; ++x, ++current_pixel)
+        unsigned char * current_pixel = image.row(y) + 1;
+        for (int x = 1; x < image.width() - 1; ++x, ++current_pixel)
         {
             *current_pixel = (*current_pixel & 1) & !((*current_pixel & 2) >> 1);
         }
     }
 }
 
-static void
-make_lut(quint8 * lut)
-{
-    quint8 neighbors[8];
-    for (int i = 0; i < 256; ++i)
-    {
-        lut[i] = 0;
-
-        // The 8 neighbors are encoded in the index.
-        neighbors[0] = (i & (1 << 0)) >> 0;
-        neighbors[1] = (i & (1 << 1)) >> 1;
-        neighbors[2] = (i & (1 << 2)) >> 2;
-        neighbors[3] = (i & (1 << 3)) >> 3;
-        neighbors[4] = (i & (1 << 4)) >> 4;
-        neighbors[5] = (i & (1 << 5)) >> 5;
-        neighbors[6] = (i & (1 << 6)) >> 6;
-        neighbors[7] = (i & (1 << 7)) >> 7;
-
-        // Sets the first bit to 1 if the conditions for the first subiteration are met.
-        if (condition_1(neighbors) &&
-            (condition_2(neighbors) &&
-                condition_3(neighbors[0], neighbors[2], neighbors[4]) &&
-                condition_3(neighbors[2], neighbors[4], neighbors[6])) ||
-            (condition_4(neighbors) &&
-                condition_5(neighbors[0], neighbors[2], neighbors[4], neighbors[5], neighbors[6]) ||
-                condition_5(neighbors[2], neighbors[4], neighbors[0], neighbors[6], neighbors[7])))
-        {
-            lut[i] |= 1;
-        }
-
-        // Sets the second bit to 1 if the conditions for the second subiteration are met.
-        if (condition_1(neighbors) &&
-            (condition_2(neighbors) &&
-                condition_3(neighbors[0], neighbors[2], neighbors[6]) &&
-                condition_3(neighbors[0], neighbors[4], neighbors[6])) ||
-            (condition_4(neighbors) &&
-                condition_5(neighbors[0], neighbors[6], neighbors[2], neighbors[3], neighbors[4]) ||
-                condition_5(neighbors[4], neighbors[6], neighbors[0], neighbors[1], neighbors[2])))
-        {
-            lut[i] |= 2;
-        }
-    }
-}
-
-QImage
-skeleton_chen_hsu(QImage const & input_image)
+void
+skeleton_chen_hsu(const_image_view input, image_view output, skeleton_scratch & scratch)
 {
-    static quint8 lut[256];
-    static bool lut_ready = false;
-    if (!lut_ready) {
-        make_lut(lut);
-        lut_ready = true;
-    }
-
-    QImage image = preprocess(input_image);
+    image_view const image = preprocess(input, scratch);
 
     while (true) {
         int n1, n2;
 
-        n1 = subiteration(image, lut, 1);
+        n1 = subiteration(image, chen_hsu_lut_1);
         if (n1 > 0) {
             remove_pixels(image);
         }
 
-        n2 = subiteration(image, lut, 2);
+        n2 = subiteration(image, chen_hsu_lut_2);
         if (n2 > 0) {
             remove_pixels(image);
         }
@@ -234,7 +123,7 @@ skeleton_chen_hsu(QImage const & input_image)
         }
     }
 
-    return postprocess(image);
+    postprocess(image, output);
 }
 
 }
@@ -0,0 +1,167 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "skeleton.hpp"
+#include "skeleton_image.hpp"
+#include "skeleton_lut.hpp"
+
+#include <array>
+#include <vector>
+
+namespace preprocessing
+{
+
+// A pixel with 8 black neighbors is never removed, so only the pixels
+// next to a white one are tested at the beginning
+static_assert(!zhang_suen_lut_1[255] && !zhang_suen_lut_2[255], "zhang_suen removes interior pixels");
+static_assert(!chen_hsu_lut_1[255] && !chen_hsu_lut_2[255], "chen_hsu removes interior pixels");
+
+// Flags of the pixels of the image. "black" is the first bit, as
+// bordered_image says, and the other ones tell if the pixel is in the
+// list of candidates of each subiteration
+enum pixel_flags : unsigned char
+{
+    black = 1,
+    candidate_1 = 2,
+    candidate_2 = 4
+};
+
+// Tests the candidates against "lut" and removes the pixels that pass.
+// A pixel is only removed after all the candidates are tested, so the
+// removed ones do not affect the rest. The black neighbors of the removed
+// pixels become candidates of both subiterations, since their neighborhood
+// changed. Returns true if any pixel was removed
+static bool
+subiteration
+(
+    bordered_image const & image,
+    thinning_lut const & lut,
+    pixel_flags candidate_flag,
+    std::vector<int> & candidates,
+    std::vector<int> (& all_candidates)[2],
+    std::vector<int> & removed_pixels
+)
+{
+    unsigned char * pixels = image.pixels;
+    int const stride = image.stride;
+
+    removed_pixels.clear();
+    for (int offset : candidates)
+    {
+        pixels[offset] &= ~candidate_flag;
+        if ((pixels[offset] & black) && lut[pack_neighbors(pixels + offset, stride)])
+        {
+            removed_pixels.push_back(offset);
+        }
+    }
+    candidates.clear();
+
+    for (int offset : removed_pixels)
+    {
+        pixels[offset] &= ~black;
+    }
+
+    std::array<int, 8> const neighbor_offsets = image.neighbor_offsets();
+    for (int offset : removed_pixels)
+    {
+        for (int neighbor_offset : neighbor_offsets)
+        {
+            int const neighbor_pixel = offset + neighbor_offset;
+            if (!(pixels[neighbor_pixel] & black))
+            {
+                continue;
+            }
+            if (!(pixels[neighbor_pixel] & candidate_1))
+            {
+                pixels[neighbor_pixel] |= candidate_1;
+                all_candidates[0].push_back(neighbor_pixel);
+            }
+            if (!(pixels[neighbor_pixel] & candidate_2))
+            {
+                pixels[neighbor_pixel] |= candidate_2;
+                all_candidates[1].push_back(neighbor_pixel);
+            }
+        }
+    }
+
+    return !removed_pixels.empty();
+}
+
+// A pixel that was tested in a subiteration gives the same result the
+// next time unless one of its neighbors is removed, so every subiteration
+// only tests the pixels that have not been tested with its table since
+// their neighborhood last changed. The removed pixels are the same as when
+// testing all of them, but the work is proportional to the pixels next
+// to the removed ones instead of to the size of the image
+static void
+skeleton_frontier
+(
+    const_image_view input,
+    image_view output,
+    skeleton_scratch & scratch,
+    thinning_lut const & lut_1,
+    thinning_lut const & lut_2
+)
+{
+    bordered_image const image = load_bordered_image(input, scratch);
+    std::vector<int> (& candidates)[2] = scratch.candidates;
+    std::vector<int> & removed_pixels = scratch.removed_pixels;
+    candidates[0].clear();
+    candidates[1].clear();
+
+    for (int y = 0; y < image.height; ++y)
+    {
+        int offset = image.offset(0, y);
+        for (int x = 0; x < image.width; ++x, ++offset)
+        {
+            unsigned char & flags = image.pixels[offset];
+            if ((flags & black) && pack_neighbors(image.pixels + offset, image.stride) != 255)
+            {
+                flags |= candidate_1 | candidate_2;
+                candidates[0].push_back(offset);
+                candidates[1].push_back(offset);
+            }
+        }
+    }
+
+    while (true)
+    {
+        bool const removed_1 = subiteration(image, lut_1, candidate_1, candidates[0], candidates, removed_pixels);
+        bool const removed_2 = subiteration(image, lut_2, candidate_2, candidates[1], candidates, removed_pixels);
+
+        if (!removed_1 && !removed_2)
+        {
+            break;
+        }
+    }
+
+    store_bordered_image(image, output);
+}
+
+void
+skeleton_zhang_suen_frontier(const_image_view input, image_view output, skeleton_scratch & scratch)
+{
+    skeleton_frontier(input, output, scratch, zhang_suen_lut_1, zhang_suen_lut_2);
+}
+
+void
+skeleton_chen_hsu_frontier(const_image_view input, image_view output, skeleton_scratch & scratch)
+{
+    skeleton_frontier(input, output, scratch, chen_hsu_lut_1, chen_hsu_lut_2);
+}
+
+}
@@ -0,0 +1,154 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SKELETON_IMAGE_HPP
+#define SKELETON_IMAGE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
+#include "skeleton.hpp"
+
+namespace preprocessing
+{
+
+// Images used by the implementations of the skeleton functions
+
+// Image with a 1 pixel border in the scratch memory, pixels are addressed
+// by their offset. The first bit of a pixel tells if it is black, as
+// pack_neighbors expects, and the other bits are free to use as flags
+struct bordered_image
+{
+    int width;
+    int height;
+    int stride;
+    unsigned char * pixels;
+
+    int
+    offset(int x, int y) const
+    {
+        return (y + 1) * stride + x + 1;
+    }
+
+    // True for the pixels in the first or last row or column of the image
+    bool
+    is_on_edge(int offset) const
+    {
+        int const x = offset % stride - 1;
+        int const y = offset / stride - 1;
+        return x == 0 || y == 0 || x == width - 1 || y == height - 1;
+    }
+
+    // Offsets of the 8 neighbors of a pixel in the order of
+    // pack_neighbors, from the top one clockwise
+    std::array<int, 8>
+    neighbor_offsets() const
+    {
+        return {-stride, -stride + 1, 1, stride + 1, stride, stride - 1, -1, -stride - 1};
+    }
+};
+
+// All the pixels, the border included, are white
+inline bordered_image
+make_bordered_image(int width, int height, skeleton_scratch & scratch)
+{
+    int const stride = width + 2;
+    scratch.pixels.assign(static_cast<std::size_t>(stride) * (height + 2), 0);
+    return bordered_image{width, height, stride, scratch.pixels.data()};
+}
+
+// The pixels of "input" with value 0 are black and the rest are white
+inline bordered_image
+load_bordered_image(const_image_view input, skeleton_scratch & scratch)
+{
+    bordered_image const image = make_bordered_image(input.width(), input.height(), scratch);
+    for (int y = 0; y < image.height; ++y)
+    {
+        unsigned char const * current_pixel = input.row(y);
+        unsigned char * current_flags = image.pixels + image.offset(0, y);
+        for (int x = 0; x < image.width; ++x, ++current_pixel, ++current_flags)
+        {
+            *current_flags = *current_pixel == 0 ? 1 : 0;
+        }
+    }
+    return image;
+}
+
+// Writes 0 for the black pixels and 255 for the white ones
+inline void
+store_bordered_image(bordered_image const & image, image_view output)
+{
+    for (int y = 0; y < image.height; ++y)
+    {
+        unsigned char * current_pixel = output.row(y);
+        unsigned char const * current_flags = image.pixels + image.offset(0, y);
+        for (int x = 0; x < image.width; ++x, ++current_pixel, ++current_flags)
+        {
+            *current_pixel = *current_flags & 1 ? 0 : 255;
+        }
+    }
+}
+
+// Rows of 64 pixels per word, as in packed_bitmap_view
+using word_type = packed_bitmap_view::word_type;
+
+inline constexpr int bits_per_word = 64;
+
+inline int
+words_per_row(int width)
+{
+    return (width + bits_per_word - 1) / bits_per_word;
+}
+
+// Packs the row of "width" pixels at "pixels" in "words", with 1 for
+// the pixels for which "is_black" returns true
+template <typename predicate_type_tp>
+void
+pack_row(unsigned char const * pixels, int width, word_type * words, predicate_type_tp is_black)
+{
+    for (int x = 0; x < width; x += bits_per_word, ++words)
+    {
+        int const size = std::min(bits_per_word, width - x);
+        word_type word = 0;
+        for (int i = 0; i < size; ++i, ++pixels)
+        {
+            word |= static_cast<word_type>(is_black(*pixels) ? 1 : 0) << i;
+        }
+        *words = word;
+    }
+}
+
+// Writes the row of "width" pixels packed in "words" to "pixels", with
+// "black_value" for the 1 bits and "white_value" for the 0 ones
+inline void
+unpack_row(word_type const * words, int width, unsigned char * pixels, unsigned char black_value, unsigned char white_value)
+{
+    for (int x = 0; x < width; x += bits_per_word, ++words)
+    {
+        int const size = std::min(bits_per_word, width - x);
+        word_type const word = *words;
+        for (int i = 0; i < size; ++i, ++pixels)
+        {
+            *pixels = (word >> i) & 1 ? black_value : white_value;
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SKELETON_LUT_HPP
+#define SKELETON_LUT_HPP
+
+#include <array>
+
+namespace preprocessing
+{
+
+// The deletion conditions of the thinning algorithms only depend on the 8
+// neighbors of a pixel, so they are precomputed for the 256 possible
+// neighborhoods. A neighborhood is packed in a byte from the top neighbor
+// clockwise: bit 0 is the top neighbor, bit 1 the top right one, bit 2 the
+// right one, ... and bit 7 the top left one. A bit is 1 if the neighbor
+// is black. The tables tell if the pixel is removed
+using thinning_lut = std::array<bool, 256>;
+
+constexpr int
+neighbor(int neighbors, int i)
+{
+    return (neighbors >> i) & 1;
+}
+
+constexpr int
+number_of_neighbors(int neighbors)
+{
+    int n = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        n += neighbor(neighbors, i);
+    }
+    return n;
+}
+
+// Number of 0 to 1 transitions in the sequence of neighbors 0, 1, ..., 7, 0
+constexpr int
+zero_one_transitions(int neighbors)
+{
+    int n = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (neighbor(neighbors, i) == 0 && neighbor(neighbors, (i + 1) % 8) == 1)
+        {
+            ++n;
+        }
+    }
+    return n;
+}
+
+constexpr bool
+all_neighbors(int neighbors, int a, int b, int c)
+{
+    return neighbor(neighbors, a) && neighbor(neighbors, b) && neighbor(neighbors, c);
+}
+
+// Thinning algorithm as explained in
+// "A Fast Parallel Algorithm for Thinning Digital Patterns"
+// by T. Y. ZHANG and C. Y. SUEN. "subiteration" is 1 or 2
+constexpr bool
+zhang_suen_removes(int neighbors, int subiteration)
+{
+    int const n = number_of_neighbors(neighbors);
+    if (n < 2 || n > 6 || zero_one_transitions(neighbors) != 1)
+    {
+        return false;
+    }
+    return subiteration == 1 ?
+        !all_neighbors(neighbors, 0, 2, 4) && !all_neighbors(neighbors, 2, 4, 6) :
+        !all_neighbors(neighbors, 0, 2, 6) && !all_neighbors(neighbors, 0, 4, 6);
+}
+
+// Condition 5 of the Chen-Hsu algorithm: "a" and "b" are black
+// and "c", "d" and "e" are white
+constexpr bool
+chen_hsu_condition_5(int neighbors, int a, int b, int c, int d, int e)
+{
+    return
+        neighbor(neighbors, a) && neighbor(neighbors, b) &&
+        !neighbor(neighbors, c) && !neighbor(neighbors, d) && !neighbor(neighbors, e);
+}
+
+// Thinning algorithm as explained in
+// "A Modified Fast Parallel Algorithm for Thinning Digital Patterns"
+// by Y. S. CHEN and W. H. HSU. "subiteration" is 1 or 2.
+// The last condition 5 does not require conditions 1 and 4, the same as
+// in the first implementation of the table, so the skeletons do not change
+constexpr bool
+chen_hsu_removes(int neighbors, int subiteration)
+{
+    int const n = number_of_neighbors(neighbors);
+    int const transitions = zero_one_transitions(neighbors);
+    bool const condition_1 = n >= 2 && n <= 7;
+    if (subiteration == 1)
+    {
+        return
+            (condition_1 && transitions == 1 &&
+                !all_neighbors(neighbors, 0, 2, 4) && !all_neighbors(neighbors, 2, 4, 6)) ||
+            (transitions == 2 && chen_hsu_condition_5(neighbors, 0, 2, 4, 5, 6)) ||
+            chen_hsu_condition_5(neighbors, 2, 4, 0, 6, 7);
+    }
+    return
+        (condition_1 && transitions == 1 &&
+            !all_neighbors(neighbors, 0, 2, 6) && !all_neighbors(neighbors, 0, 4, 6)) ||
+        (transitions == 2 && chen_hsu_condition_5(neighbors, 0, 6, 2, 3, 4)) ||
+        chen_hsu_condition_5(neighbors, 4, 6, 0, 1, 2);
+}
+
+template <typename function_type_tp>
+constexpr thinning_lut
+make_thinning_lut(function_type_tp removes, int subiteration)
+{
+    thinning_lut lut{};
+    for (int i = 0; i < 256; ++i)
+    {
+        lut[i] = removes(i, subiteration);
+    }
+    return lut;
+}
+
+inline constexpr thinning_lut zhang_suen_lut_1 = make_thinning_lut(zhang_suen_removes, 1);
+inline constexpr thinning_lut zhang_suen_lut_2 = make_thinning_lut(zhang_suen_removes, 2);
+inline constexpr thinning_lut chen_hsu_lut_1 = make_thinning_lut(chen_hsu_removes, 1);
+inline constexpr thinning_lut chen_hsu_lut_2 = make_thinning_lut(chen_hsu_removes, 2);
+
+// Packs the neighbors of "pixel", in an image of 0 and 1 values with
+// "stride" bytes per row. Only the first bit of the neighbors is used
+inline int
+pack_neighbors(unsigned char const * pixel, int stride)
+{
+    return
+        ((*(pixel - stride) & 1) << 0) |
+        ((*(pixel - stride + 1) & 1) << 1) |
+        ((*(pixel + 1) & 1) << 2) |
+        ((*(pixel + stride + 1) & 1) << 3) |
+        ((*(pixel + stride) & 1) << 4) |
+        ((*(pixel + stride - 1) & 1) << 5) |
+        ((*(pixel - 1) & 1) << 6) |
+        ((*(pixel - stride - 1) & 1) << 7);
+}
+
+}
+
+#endif
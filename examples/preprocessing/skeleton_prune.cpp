@@ -0,0 +1,379 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "skeleton.hpp"
+#include "skeleton_image.hpp"
+#include "skeleton_lut.hpp"
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace preprocessing
+{
+
+// Flags of the pixels of the image. "black" is the first bit, as
+// bordered_image says, and "visited" marks the pixels of the branch or
+// component being walked
+enum prune_pixel_flags : unsigned char
+{
+    black = 1,
+    visited = 2
+};
+
+using neighborhood_lut = std::array<bool, 256>;
+
+// The black neighbors of an end point are 1 pixel, or 2 pixels next to
+// each other
+constexpr bool
+is_end_point(int neighbors)
+{
+    int const n = number_of_neighbors(neighbors);
+    return n >= 1 && n <= 2 && zero_one_transitions(neighbors) == 1;
+}
+
+// The black neighbors of a junction are 3 or more separate groups
+constexpr bool
+is_junction(int neighbors)
+{
+    return zero_one_transitions(neighbors) >= 3;
+}
+
+// Removing a simple pixel does not change the 8-connected black components
+// nor the 4-connected white ones, which is when its 8-connectivity number is
+// 1, as explained in "Topological Properties in Digitized Binary Pictures"
+// by S. YOKOI, J. TORIWAKI and T. FUKUMURA
+constexpr bool
+is_simple_point(int neighbors)
+{
+    int n = 0;
+    for (int i = 0; i < 8; i += 2)
+    {
+        int const a = 1 - neighbor(neighbors, i);
+        int const b = 1 - neighbor(neighbors, i + 1);
+        int const c = 1 - neighbor(neighbors, (i + 2) % 8);
+        n += a - a * b * c;
+    }
+    return n == 1;
+}
+
+template <typename function_type_tp>
+constexpr neighborhood_lut
+make_neighborhood_lut(function_type_tp f)
+{
+    neighborhood_lut lut{};
+    for (int i = 0; i < 256; ++i)
+    {
+        lut[i] = f(i);
+    }
+    return lut;
+}
+
+static constexpr neighborhood_lut end_point_lut = make_neighborhood_lut(is_end_point);
+static constexpr neighborhood_lut junction_lut = make_neighborhood_lut(is_junction);
+static constexpr neighborhood_lut simple_point_lut = make_neighborhood_lut(is_simple_point);
+
+static_assert(!simple_point_lut[0] && !simple_point_lut[255], "isolated and interior pixels are not simple");
+static_assert(simple_point_lut[1] && simple_point_lut[3], "end points are simple");
+static_assert(!simple_point_lut[1 | 16] && !simple_point_lut[2 | 32], "line pixels are not simple");
+
+// Walks the branch that starts at the end point "offset" until it reaches
+// a junction, and removes the branch if it has less than "minimum_length"
+// pixels. A branch that ends in another end point is a whole component,
+// which is left to remove_small_components.
+// The thick clumps that thinning leaves at some junctions have no pixel
+// that passes junction_lut, so the walk can go through them and into
+// another stroke. The pixels are therefore removed from the end point and
+// only while they are simple, which stops at the first pixel that joins
+// two strokes or closes a loop. The pixels on the edge of the image are
+// never removed either, since a stroke that reaches the edge closes the
+// regions between them. Pruning never splits a component or opens a closed
+// stroke, which would make the colors leak
+static void
+prune_branch(bordered_image const & image, int offset, int minimum_length, std::vector<int> & branch)
+{
+    unsigned char * pixels = image.pixels;
+    int const stride = image.stride;
+    // The 4-connected neighbors go first, so the corners of the diagonal
+    // steps of the skeleton are not left behind
+    std::array<int, 8> const clockwise_offsets = image.neighbor_offsets();
+    int const neighbor_offsets[8] =
+    {
+        clockwise_offsets[0], clockwise_offsets[2], clockwise_offsets[4], clockwise_offsets[6],
+        clockwise_offsets[1], clockwise_offsets[3], clockwise_offsets[5], clockwise_offsets[7]
+    };
+
+    branch.clear();
+    bool reached_junction = false;
+    int current_pixel = offset;
+    while (true)
+    {
+        pixels[current_pixel] |= visited;
+        branch.push_back(current_pixel);
+        if (static_cast<int>(branch.size()) >= minimum_length)
+        {
+            break;
+        }
+
+        int next_pixel = -1;
+        for (int neighbor_offset : neighbor_offsets)
+        {
+            if ((pixels[current_pixel + neighbor_offset] & (black | visited)) == black)
+            {
+                next_pixel = current_pixel + neighbor_offset;
+                break;
+            }
+        }
+        if (next_pixel == -1)
+        {
+            break;
+        }
+        if (junction_lut[pack_neighbors(pixels + next_pixel, stride)])
+        {
+            reached_junction = true;
+            break;
+        }
+        current_pixel = next_pixel;
+    }
+
+    for (int branch_pixel : branch)
+    {
+        pixels[branch_pixel] &= ~visited;
+    }
+
+    if (!reached_junction)
+    {
+        return;
+    }
+    for (int branch_pixel : branch)
+    {
+        if (image.is_on_edge(branch_pixel) || !simple_point_lut[pack_neighbors(pixels + branch_pixel, stride)])
+        {
+            break;
+        }
+        pixels[branch_pixel] &= ~black;
+    }
+}
+
+// The end points are found before removing any branch, so the pixels that
+// become end points when a branch is removed are not walked. That keeps
+// a single pass from eating the strokes from their ends
+static void
+prune_branches(bordered_image const & image, int minimum_length, std::vector<int> & end_points, std::vector<int> & branch)
+{
+    unsigned char * pixels = image.pixels;
+    int const stride = image.stride;
+
+    end_points.clear();
+    for (int y = 0; y < image.height; ++y)
+    {
+        int offset = image.offset(0, y);
+        for (int x = 0; x < image.width; ++x, ++offset)
+        {
+            if ((pixels[offset] & black) && end_point_lut[pack_neighbors(pixels + offset, stride)])
+            {
+                end_points.push_back(offset);
+            }
+        }
+    }
+
+    for (int offset : end_points)
+    {
+        // The end point might have been removed with another branch
+        if ((pixels[offset] & black) && end_point_lut[pack_neighbors(pixels + offset, stride)])
+        {
+            prune_branch(image, offset, minimum_length, branch);
+        }
+    }
+}
+
+// Four times what the black pixel at "offset" adds to the Euler number of
+// its 8-connected component, which is 1 minus the number of regions the
+// component encloses. Each block of 2x2 pixels adds 1 if it has 1 black
+// pixel, -1 if it has 3 and -2 if it has 2 diagonal ones, as explained in
+// "Local Properties of Binary Images in Two Dimensions" by S. B. GRAY.
+// A block is counted by its first black pixel in raster order, and the
+// blocks of a component do not have pixels of other components
+static int
+euler_number_contribution(bordered_image const & image, int offset)
+{
+    unsigned char const * pixels = image.pixels;
+    int const stride = image.stride;
+    // The pixel is the top left, top right, bottom left and bottom right
+    // one of these blocks
+    int const block_offsets[4] = {offset, offset - 1, offset - stride, offset - stride - 1};
+
+    int n = 0;
+    for (int position = 0; position < 4; ++position)
+    {
+        int const block_offset = block_offsets[position];
+        int const block[4] =
+        {
+            pixels[block_offset] & black,
+            pixels[block_offset + 1] & black,
+            pixels[block_offset + stride] & black,
+            pixels[block_offset + stride + 1] & black
+        };
+        bool is_first_black_pixel = true;
+        for (int i = 0; i < position; ++i)
+        {
+            is_first_black_pixel = is_first_black_pixel && !block[i];
+        }
+        if (!is_first_black_pixel)
+        {
+            continue;
+        }
+
+        int const number_of_black_pixels = block[0] + block[1] + block[2] + block[3];
+        if (number_of_black_pixels == 1)
+        {
+            n += 1;
+        }
+        else if (number_of_black_pixels == 3)
+        {
+            n -= 1;
+        }
+        else if (number_of_black_pixels == 2 && block[0] == block[3])
+        {
+            n -= 2;
+        }
+    }
+    return n;
+}
+
+// Removes the 8-connected components with less than "minimum_size"
+// pixels. A component that encloses a region, like a small circle, or that
+// reaches the edge of the image separates regions of the drawing however
+// small it is, so it is kept, since removing it would make the colors
+// leak. The pixels are left with the visited flag
+static void
+remove_small_components(bordered_image const & image, int minimum_size, std::vector<int> & stack, std::vector<int> & component)
+{
+    unsigned char * pixels = image.pixels;
+    std::array<int, 8> const neighbor_offsets = image.neighbor_offsets();
+
+    for (int y = 0; y < image.height; ++y)
+    {
+        int offset = image.offset(0, y);
+        for (int x = 0; x < image.width; ++x, ++offset)
+        {
+            if ((pixels[offset] & (black | visited)) != black)
+            {
+                continue;
+            }
+
+            component.clear();
+            stack.clear();
+            int euler_number_times_4 = 0;
+            bool is_on_edge = false;
+            pixels[offset] |= visited;
+            stack.push_back(offset);
+            while (!stack.empty())
+            {
+                int const current_pixel = stack.back();
+                stack.pop_back();
+                component.push_back(current_pixel);
+                euler_number_times_4 += euler_number_contribution(image, current_pixel);
+                is_on_edge = is_on_edge || image.is_on_edge(current_pixel);
+                for (int neighbor_offset : neighbor_offsets)
+                {
+                    int const neighbor_pixel = current_pixel + neighbor_offset;
+                    if ((pixels[neighbor_pixel] & (black | visited)) == black)
+                    {
+                        pixels[neighbor_pixel] |= visited;
+                        stack.push_back(neighbor_pixel);
+                    }
+                }
+            }
+
+            // The Euler number of a component without holes is 1
+            if (euler_number_times_4 == 4 && !is_on_edge && static_cast<int>(component.size()) < minimum_size)
+            {
+                for (int component_pixel : component)
+                {
+                    pixels[component_pixel] &= ~black;
+                }
+            }
+        }
+    }
+}
+
+static void
+prune(bordered_image const & image, int minimum_branch_length, int minimum_component_size, skeleton_scratch & scratch)
+{
+    // The components are removed after the branches, so the pieces that
+    // are left of a speck once its branches are pruned are removed too
+    if (minimum_branch_length > 1)
+    {
+        prune_branches(image, minimum_branch_length, scratch.candidates[0], scratch.removed_pixels);
+    }
+    if (minimum_component_size > 1)
+    {
+        remove_small_components(image, minimum_component_size, scratch.candidates[0], scratch.removed_pixels);
+    }
+}
+
+void
+prune_skeleton
+(
+    const_image_view input,
+    image_view output,
+    int minimum_branch_length,
+    int minimum_component_size,
+    skeleton_scratch & scratch
+)
+{
+    bordered_image const image = load_bordered_image(input, scratch);
+    prune(image, minimum_branch_length, minimum_component_size, scratch);
+    store_bordered_image(image, output);
+}
+
+packed_bitmap_view
+prune_skeleton
+(
+    packed_bitmap_view skeleton,
+    int minimum_branch_length,
+    int minimum_component_size,
+    skeleton_scratch & scratch
+)
+{
+    bordered_image const image = make_bordered_image(skeleton.width(), skeleton.height(), scratch);
+    int const row_words = words_per_row(image.width);
+    for (int y = 0; y < image.height; ++y)
+    {
+        unpack_row(skeleton.row(y), image.width, image.pixels + image.offset(0, y), black, 0);
+    }
+
+    prune(image, minimum_branch_length, minimum_component_size, scratch);
+
+    // "skeleton" might point to these words, but it is not read anymore
+    scratch.words.assign(static_cast<std::size_t>(row_words) * image.height, 0);
+    for (int y = 0; y < image.height; ++y)
+    {
+        pack_row
+        (
+            image.pixels + image.offset(0, y),
+            image.width,
+            scratch.words.data() + static_cast<std::size_t>(y) * row_words,
+            [](unsigned char flags) { return (flags & black) != 0; }
+        );
+    }
+
+    return packed_bitmap_view(scratch.words.data(), image.width, image.height, row_words);
+}
+
+}
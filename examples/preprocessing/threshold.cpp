@@ -17,23 +17,162 @@
 
 #include "threshold.hpp"
 
+#include <lazybrush/parallel.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PREPROCESSING_THRESHOLD_SSE2
+#include <emmintrin.h>
+// AVX2 is selected at runtime, which needs the target attribute and
+// the cpu detection builtins of gcc and clang
+#if defined(__GNUC__) || defined(__clang__)
+#define PREPROCESSING_THRESHOLD_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PREPROCESSING_THRESHOLD_NEON
+#include <arm_neon.h>
+#endif
+
 namespace preprocessing
 {
 
-QImage
-threshold(QImage const & input_image, int v)
+// Below this number of pixels per thread, handing the rows to
+// the thread pool costs more than what it saves
+static constexpr int minimum_pixels_per_thread = 1 << 18;
+
+// The row functions set the pixels lower than "v" to 0 and the rest
+// to 255. "v" must be in [1, 255], so "pixel >= v" is the same as
+// "min(pixel, v) == v", which the SIMD versions compute on 16 or 32
+// pixels at once. Each block is loaded before it is stored, so
+// "input" and "output" can be the same row
+using threshold_row_function = void (*)(unsigned char const *, unsigned char *, int, unsigned char);
+
+static void
+threshold_row_scalar(unsigned char const * input, unsigned char * output, int width, unsigned char v)
 {
-    QImage outpu_image(input_image.width(), input_image.height(), input_image.format());
-    for (int y = 0; y < input_image.height(); ++y)
+    for (int x = 0; x < width; ++x)
     {
-        quint8 const * current_pixel_1 = static_cast<const quint8 *>(input_image.scanLine(y));
-        quint8 * current_pixel_2 = static_cast<quint8 *>(outpu_image.scanLine(y));
-        for (int x = 0; x < input_image.width(); ++x, ++current_pixel_1, ++current_pixel_2)
-        {
-            *current_pixel_2 = *current_pixel_1 < v ? 0 : 255;
-        }
+        output[x] = input[x] < v ? 0 : 255;
+    }
+}
+
+#if defined(PREPROCESSING_THRESHOLD_SSE2)
+static void
+threshold_row_sse2(unsigned char const * input, unsigned char * output, int width, unsigned char v)
+{
+    __m128i const threshold_value = _mm_set1_epi8(static_cast<char>(v));
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(input + x));
+        __m128i const result = _mm_cmpeq_epi8(_mm_min_epu8(pixels, threshold_value), threshold_value);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + x), result);
+    }
+    threshold_row_scalar(input + x, output + x, width - x, v);
+}
+#endif
+
+#if defined(PREPROCESSING_THRESHOLD_AVX2)
+__attribute__((target("avx2")))
+static void
+threshold_row_avx2(unsigned char const * input, unsigned char * output, int width, unsigned char v)
+{
+    __m256i const threshold_value = _mm256_set1_epi8(static_cast<char>(v));
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(input + x));
+        __m256i const result = _mm256_cmpeq_epi8(_mm256_min_epu8(pixels, threshold_value), threshold_value);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + x), result);
+    }
+    threshold_row_sse2(input + x, output + x, width - x, v);
+}
+#endif
+
+#if defined(PREPROCESSING_THRESHOLD_NEON)
+static void
+threshold_row_neon(unsigned char const * input, unsigned char * output, int width, unsigned char v)
+{
+    uint8x16_t const threshold_value = vdupq_n_u8(v);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        vst1q_u8(output + x, vcgeq_u8(vld1q_u8(input + x), threshold_value));
+    }
+    threshold_row_scalar(input + x, output + x, width - x, v);
+}
+#endif
+
+// Best row function supported by the cpu the program runs on
+static threshold_row_function
+select_threshold_row_function()
+{
+#if defined(PREPROCESSING_THRESHOLD_AVX2)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return threshold_row_avx2;
     }
-    return outpu_image;
+#endif
+#if defined(PREPROCESSING_THRESHOLD_SSE2)
+    return threshold_row_sse2;
+#elif defined(PREPROCESSING_THRESHOLD_NEON)
+    return threshold_row_neon;
+#else
+    return threshold_row_scalar;
+#endif
+}
+
+void
+threshold(const_image_view input, image_view output, int v)
+{
+    int const width = input.width();
+    int const height = input.height();
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    static threshold_row_function const threshold_row = select_threshold_row_function();
+
+    int const number_of_threads =
+        std::max
+        (
+            1,
+            std::min
+            (
+                lazybrush::default_number_of_threads(),
+                static_cast<int>(static_cast<long long>(width) * height / minimum_pixels_per_thread)
+            )
+        );
+
+    lazybrush::parallel_for
+    (
+        0,
+        height,
+        [=](int first_row, int last_row)
+        {
+            for (int y = first_row; y < last_row; ++y)
+            {
+                unsigned char const * input_row = input.row(y);
+                unsigned char * output_row = output.row(y);
+                // All the pixels are on the same side of the threshold
+                if (v <= 0 || v > 255)
+                {
+                    std::memset(output_row, v <= 0 ? 255 : 0, width);
+                }
+                else
+                {
+                    threshold_row(input_row, output_row, width, static_cast<unsigned char>(v));
+                }
+            }
+        },
+        number_of_threads
+    );
 }
 
 }
@@ -18,13 +18,17 @@
 #ifndef THRESHOLD_HPP
 #define THRESHOLD_HPP
 
-#include <QImage>
+#include "image_view.hpp"
 
 namespace preprocessing
 {
 
-QImage
-threshold(QImage const & input_image, int v);
+// Sets the pixels of "output" whose pixel in "input" has a value lower
+// than "v" to 0 (black) and the rest to 255 (white). Both images must have
+// the same size, and "output" can be "input" to threshold it in place.
+// Large images are processed by several threads
+void
+threshold(const_image_view input, image_view output, int v);
 
 }
 
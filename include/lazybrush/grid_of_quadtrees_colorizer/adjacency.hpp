@@ -0,0 +1,350 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_ADJACENCY_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_ADJACENCY_HPP
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
+
+#include "types.hpp"
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+enum neighbor_side
+{
+    top_side,
+    left_side,
+    bottom_side,
+    right_side,
+    number_of_sides
+};
+
+struct leaf_neighbor
+{
+    // Index of the neighbor leaf
+    int index;
+    // Length of the border shared with the neighbor leaf
+    int border_length;
+};
+
+// Neighbors of every leaf of a grid, stored in compressed rows: the leaves
+// are numbered and the neighbors at each side of a leaf are a contiguous
+// range of the neighbors vector. "leaf_reference_type_tp" is what the
+// leaves are referred by: a cell pointer of grid or a handle of linear_grid
+template <typename leaf_reference_type_tp>
+class leaf_adjacency_table
+{
+public:
+    using leaf_reference_type = leaf_reference_type_tp;
+
+    class neighbor_range
+    {
+    public:
+        neighbor_range(leaf_neighbor const * begin, leaf_neighbor const * end)
+            : begin_(begin)
+            , end_(end)
+        {}
+
+        leaf_neighbor const *
+        begin() const
+        {
+            return begin_;
+        }
+
+        leaf_neighbor const *
+        end() const
+        {
+            return end_;
+        }
+
+        int
+        size() const
+        {
+            return static_cast<int>(end_ - begin_);
+        }
+
+        bool
+        empty() const
+        {
+            return begin_ == end_;
+        }
+
+    private:
+        leaf_neighbor const * begin_;
+        leaf_neighbor const * end_;
+    };
+
+    leaf_adjacency_table()
+        : offsets_(1, 0)
+    {}
+
+    // "offsets" has number_of_sides entries per leaf plus a last one with
+    // the size of "neighbors". The neighbors at side "s" of the leaf "i"
+    // are in [offsets[i * number_of_sides + s], offsets[i * number_of_sides + s + 1])
+    leaf_adjacency_table
+    (
+        std::vector<leaf_reference_type> leaves,
+        std::vector<int> offsets,
+        std::vector<leaf_neighbor> neighbors
+    )
+        : leaves_(std::move(leaves))
+        , offsets_(std::move(offsets))
+        , neighbors_(std::move(neighbors))
+    {}
+
+    int
+    size() const
+    {
+        return static_cast<int>(leaves_.size());
+    }
+
+    std::vector<leaf_reference_type> const &
+    leaves() const
+    {
+        return leaves_;
+    }
+
+    leaf_reference_type
+    leaf(int index) const
+    {
+        return leaves_[index];
+    }
+
+    // Neighbors at the given side of the leaf at "index", from left
+    // to right or from top to bottom
+    neighbor_range
+    neighbors(int index, neighbor_side side) const
+    {
+        int const row = index * number_of_sides + side;
+        return neighbor_range(neighbors_.data() + offsets_[row], neighbors_.data() + offsets_[row + 1]);
+    }
+
+    // Neighbors at all sides of the leaf at "index"
+    neighbor_range
+    neighbors(int index) const
+    {
+        int const row = index * number_of_sides;
+        return neighbor_range(neighbors_.data() + offsets_[row], neighbors_.data() + offsets_[row + number_of_sides]);
+    }
+
+    // Bytes used by the table
+    std::size_t
+    memory_usage() const
+    {
+        return
+            leaves_.capacity() * sizeof(leaf_reference_type) +
+            offsets_.capacity() * sizeof(int) +
+            neighbors_.capacity() * sizeof(leaf_neighbor);
+    }
+
+private:
+    std::vector<leaf_reference_type> leaves_;
+    std::vector<int> offsets_;
+    std::vector<leaf_neighbor> neighbors_;
+};
+
+namespace detail
+{
+
+// Stable counting sort of "items" by "key", whose values are in [0, number_of_keys).
+// "offsets" gets, for every key, where its items start in the result
+template <typename key_function_type_tp>
+std::vector<int>
+counting_sort(std::vector<int> const & items, int number_of_keys, key_function_type_tp key, std::vector<int> & offsets)
+{
+    offsets.assign(number_of_keys + 1, 0);
+    for (int item : items)
+    {
+        ++offsets[key(item) + 1];
+    }
+    for (int i = 0; i < number_of_keys; ++i)
+    {
+        offsets[i + 1] += offsets[i];
+    }
+    std::vector<int> sorted_items(items.size());
+    std::vector<int> positions(offsets.begin(), offsets.end() - 1);
+    for (int item : items)
+    {
+        sorted_items[positions[key(item)]++] = item;
+    }
+    return sorted_items;
+}
+
+struct leaf_neighbor_entry
+{
+    int row;
+    leaf_neighbor neighbor;
+};
+
+}
+
+// Finds the neighbors of a set of leaves that partition "rect", in time
+// linear in the number of leaves plus the size of "rect".
+// The leaves are bucketed by the vertical and horizontal lines their sides
+// lie on, sorted along each line with counting sorts. On every line, the
+// leaves that end there and the ones that start there cover the whole line,
+// so merging both sorted lists yields every pair of adjacent leaves and the
+// length of their shared border.
+// The leaves are numbered in the order they have in "leaves". If
+// "find_top_left_neighbors_only" is true only the top and left neighbors are
+// stored, which is enough to know every pair of adjacent leaves once
+template <typename leaf_reference_type_tp>
+leaf_adjacency_table<leaf_reference_type_tp>
+make_leaf_adjacency_table
+(
+    rect<int> const & rect,
+    std::vector<leaf_reference_type_tp> leaves,
+    bool find_top_left_neighbors_only = false
+)
+{
+    int const number_of_leaves = static_cast<int>(leaves.size());
+
+    // Leaf rects relative to "rect"
+    std::vector<int> lefts(number_of_leaves);
+    std::vector<int> tops(number_of_leaves);
+    std::vector<int> rights(number_of_leaves);
+    std::vector<int> bottoms(number_of_leaves);
+    std::vector<int> all_leaves(number_of_leaves);
+    for (int i = 0; i < number_of_leaves; ++i)
+    {
+        auto const & leaf_rect = leaves[i]->rect();
+        lefts[i] = leaf_rect.left() - rect.left();
+        tops[i] = leaf_rect.top() - rect.top();
+        rights[i] = leaf_rect.right() - rect.left();
+        bottoms[i] = leaf_rect.bottom() - rect.top();
+        all_leaves[i] = i;
+    }
+
+    std::vector<detail::leaf_neighbor_entry> entries;
+    entries.reserve(static_cast<std::size_t>(number_of_leaves) * (find_top_left_neighbors_only ? 2 : 4));
+
+    // Merges the leaves that end just before a line ("before") with the ones
+    // that start on it ("after"), both sorted along the line
+    auto merge_line =
+        [&entries, find_top_left_neighbors_only]
+        (
+            int const * before, int const * before_end,
+            int const * after, int const * after_end,
+            std::vector<int> const & starts, std::vector<int> const & ends,
+            neighbor_side after_side, neighbor_side before_side
+        )
+        {
+            while (before != before_end && after != after_end)
+            {
+                int const first = std::max(starts[*before], starts[*after]);
+                int const last = std::min(ends[*before], ends[*after]);
+                if (last >= first)
+                {
+                    int const border_length = last - first + 1;
+                    entries.push_back({*after * number_of_sides + after_side, {*before, border_length}});
+                    if (!find_top_left_neighbors_only)
+                    {
+                        entries.push_back({*before * number_of_sides + before_side, {*after, border_length}});
+                    }
+                }
+                int const before_last = ends[*before];
+                int const after_last = ends[*after];
+                if (before_last <= after_last)
+                {
+                    ++before;
+                }
+                if (after_last <= before_last)
+                {
+                    ++after;
+                }
+            }
+        };
+
+    // Vertical lines: left and right neighbors, sorted from top to bottom
+    {
+        std::vector<int> offsets;
+        std::vector<int> const by_top =
+            detail::counting_sort(all_leaves, rect.height(), [&tops](int i) { return tops[i]; }, offsets);
+        std::vector<int> start_offsets;
+        std::vector<int> const starting =
+            detail::counting_sort(by_top, rect.width() + 1, [&lefts](int i) { return lefts[i]; }, start_offsets);
+        std::vector<int> end_offsets;
+        std::vector<int> const ending =
+            detail::counting_sort(by_top, rect.width() + 1, [&rights](int i) { return rights[i] + 1; }, end_offsets);
+        for (int x = 1; x < rect.width(); ++x)
+        {
+            merge_line
+            (
+                ending.data() + end_offsets[x], ending.data() + end_offsets[x + 1],
+                starting.data() + start_offsets[x], starting.data() + start_offsets[x + 1],
+                tops, bottoms,
+                left_side, right_side
+            );
+        }
+    }
+
+    // Horizontal lines: top and bottom neighbors, sorted from left to right
+    {
+        std::vector<int> offsets;
+        std::vector<int> const by_left =
+            detail::counting_sort(all_leaves, rect.width(), [&lefts](int i) { return lefts[i]; }, offsets);
+        std::vector<int> start_offsets;
+        std::vector<int> const starting =
+            detail::counting_sort(by_left, rect.height() + 1, [&tops](int i) { return tops[i]; }, start_offsets);
+        std::vector<int> end_offsets;
+        std::vector<int> const ending =
+            detail::counting_sort(by_left, rect.height() + 1, [&bottoms](int i) { return bottoms[i] + 1; }, end_offsets);
+        for (int y = 1; y < rect.height(); ++y)
+        {
+            merge_line
+            (
+                ending.data() + end_offsets[y], ending.data() + end_offsets[y + 1],
+                starting.data() + start_offsets[y], starting.data() + start_offsets[y + 1],
+                lefts, rights,
+                top_side, bottom_side
+            );
+        }
+    }
+
+    // Group the entries by leaf and side. The sort is stable, so the
+    // neighbors of each side keep the order of their line
+    std::vector<int> offsets(static_cast<std::size_t>(number_of_leaves) * number_of_sides + 1, 0);
+    for (detail::leaf_neighbor_entry const & entry : entries)
+    {
+        ++offsets[entry.row + 1];
+    }
+    for (std::size_t row = 1; row < offsets.size(); ++row)
+    {
+        offsets[row] += offsets[row - 1];
+    }
+    std::vector<leaf_neighbor> neighbors(entries.size());
+    {
+        std::vector<int> positions(offsets.begin(), offsets.end() - 1);
+        for (detail::leaf_neighbor_entry const & entry : entries)
+        {
+            neighbors[positions[entry.row]++] = entry.neighbor;
+        }
+    }
+
+    return leaf_adjacency_table<leaf_reference_type_tp>(std::move(leaves), std::move(offsets), std::move(neighbors));
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,286 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_CELL_SIZE_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_CELL_SIZE_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+
+#include "types.hpp"
+#include "raster.hpp"
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+// Passing this as the cell size to the colorization context constructors
+// makes them choose it with suggest_cell_size
+constexpr int automatic_cell_size = 0;
+
+// Weights of the cost model used to choose the size of the top level cells.
+// The cost of a cell size is the cost of one edit: rebuilding the trees
+// touched by a scribble and solving the graph of leaves afterwards
+struct cell_size_cost_model
+{
+    // Cost of every leaf. The leaves are the nodes of the graph
+    // solved in each colorization
+    double leaf_cost{1.0};
+    // Cost of every top level cell on top of its leaves: its traversal
+    // setup and the neighbor searches that cross tree boundaries
+    double top_level_cell_cost{1.0};
+    // Cost of every node rebuilt when a scribble of "edit_size"
+    // pixels is added or removed
+    double edit_node_cost{1.0};
+    int edit_size{64};
+};
+
+struct cell_size_estimate
+{
+    int cell_size;
+    long long top_level_cells;
+    long long leaves;
+    double nodes_per_edit;
+    double cost;
+};
+
+// Counts how many aligned blocks of each power of two size contain points.
+// The number of leaves of a grid only depends on these counts: a tree gets
+// subdivided once for every occupied block of size 2 or more, so a grid with
+// cells of size "s" has "top level cells + 3 * sum(occupied blocks of size
+// 2 to s)" leaves.
+// Only blocks of "min_cell_size" or more are counted exactly, the smaller
+// ones are interpolated from that level and the number of points, which
+// keeps the histogram small even for very large pages
+class density_histogram
+{
+public:
+    using point_type = point<int>;
+    using rect_type = lazybrush::grid_of_quadtrees_colorizer::rect<int>;
+
+    density_histogram(rect_type const & rect, int min_cell_size = 8, int max_cell_size = 256)
+        : rect_(rect)
+        , min_cell_size_(min_cell_size)
+        , max_cell_size_(std::max(min_cell_size, max_cell_size))
+    {
+        width_in_blocks_ = (rect.width() + min_cell_size_ - 1) / min_cell_size_;
+        height_in_blocks_ = (rect.height() + min_cell_size_ - 1) / min_cell_size_;
+        blocks_ = std::vector<unsigned char>(static_cast<std::size_t>(width_in_blocks_) * height_in_blocks_, 0);
+    }
+
+    void
+    add_point(point_type const & point)
+    {
+        if (!rect_.contains(point))
+        {
+            return;
+        }
+        int const x = (point.x() - rect_.left()) / min_cell_size_;
+        int const y = (point.y() - rect_.top()) / min_cell_size_;
+        blocks_[static_cast<std::size_t>(y) * width_in_blocks_ + x] = 1;
+        ++number_of_points_;
+    }
+
+    // Add the pixels with a value lower than "threshold" of a strided
+    // 8 bits raster that covers the rect of the histogram
+    void
+    add_points(unsigned char const * data, int stride, int threshold)
+    {
+        add_raster_points(threshold_raster{data, rect_.width(), rect_.height(), stride, threshold});
+    }
+
+    // Add the points of a raster (see raster.hpp) that covers
+    // the rect of the histogram
+    template <typename raster_type_tp>
+    void
+    add_raster_points(raster_type_tp const & raster)
+    {
+        int const width = std::min(raster.width(), rect_.width());
+        int const height = std::min(raster.height(), rect_.height());
+        for (int y = 0; y < height; ++y)
+        {
+            unsigned char * block_row = blocks_.data() + static_cast<std::size_t>(y / min_cell_size_) * width_in_blocks_;
+            for (int x = 0; x < width; ++x)
+            {
+                if (raster.is_point(x, y))
+                {
+                    block_row[x / min_cell_size_] = 1;
+                    ++number_of_points_;
+                }
+            }
+        }
+    }
+
+    // Estimates for every power of two cell size
+    // between min_cell_size and max_cell_size
+    std::vector<cell_size_estimate>
+    estimate(cell_size_cost_model const & model = cell_size_cost_model()) const
+    {
+        // Exact counts of occupied blocks, from min_cell_size up
+        std::vector<long long> occupied_blocks;
+        {
+            std::vector<unsigned char> level = blocks_;
+            int width = width_in_blocks_;
+            int height = height_in_blocks_;
+            for (int size = min_cell_size_; size <= max_cell_size_; size *= 2)
+            {
+                occupied_blocks.push_back(std::count(level.begin(), level.end(), 1));
+
+                int const next_width = (width + 1) / 2;
+                int const next_height = (height + 1) / 2;
+                std::vector<unsigned char> next_level(static_cast<std::size_t>(next_width) * next_height, 0);
+                for (int y = 0; y < height; ++y)
+                {
+                    for (int x = 0; x < width; ++x)
+                    {
+                        next_level[static_cast<std::size_t>(y / 2) * next_width + x / 2] |=
+                            level[static_cast<std::size_t>(y) * width + x];
+                    }
+                }
+                level.swap(next_level);
+                width = next_width;
+                height = next_height;
+            }
+        }
+
+        // Internal nodes below min_cell_size. The occupied blocks of size 1
+        // are the points and the ones of size min_cell_size are known, so the
+        // sizes in between are interpolated in log scale (a line halves its
+        // occupied blocks each time the block size doubles, a filled area
+        // divides them by four and a speck keeps them)
+        double fine_internal_nodes = 0.0;
+        {
+            double const points = std::max(static_cast<double>(number_of_points_), 1.0);
+            double const occupied = std::max(static_cast<double>(occupied_blocks[0]), 1.0);
+            double const levels = std::log2(static_cast<double>(min_cell_size_));
+            for (int size = 2; size <= min_cell_size_; size *= 2)
+            {
+                double const t = std::log2(static_cast<double>(size)) / levels;
+                fine_internal_nodes += std::pow(points, 1.0 - t) * std::pow(occupied, t);
+            }
+            if (occupied_blocks[0] == 0)
+            {
+                fine_internal_nodes = 0.0;
+            }
+        }
+
+        std::vector<cell_size_estimate> estimates;
+        double internal_nodes = fine_internal_nodes;
+        for (std::size_t level = 0; level < occupied_blocks.size(); ++level)
+        {
+            int const cell_size = min_cell_size_ << level;
+            if (level > 0)
+            {
+                internal_nodes += static_cast<double>(occupied_blocks[level]);
+            }
+
+            long long const width_in_cells = (rect_.width() + cell_size - 1) / cell_size;
+            long long const height_in_cells = (rect_.height() + cell_size - 1) / cell_size;
+            long long const top_level_cells = width_in_cells * height_in_cells;
+            double const leaves = static_cast<double>(top_level_cells) + 3.0 * internal_nodes;
+
+            // An edit touches, on average, (1 + (edit_size - 1) / cell_size)
+            // cells in each direction, and every one of them holds the
+            // average number of nodes per tree
+            double const cells_per_side = 1.0 + static_cast<double>(model.edit_size - 1) / cell_size;
+            double const cells_per_edit =
+                std::min(std::min(cells_per_side, static_cast<double>(width_in_cells)) *
+                         std::min(cells_per_side, static_cast<double>(height_in_cells)),
+                         static_cast<double>(top_level_cells));
+            double const nodes_per_cell = (static_cast<double>(top_level_cells) + 4.0 * internal_nodes) / top_level_cells;
+            double const nodes_per_edit = cells_per_edit * nodes_per_cell;
+
+            cell_size_estimate estimate;
+            estimate.cell_size = cell_size;
+            estimate.top_level_cells = top_level_cells;
+            estimate.leaves = static_cast<long long>(leaves);
+            estimate.nodes_per_edit = nodes_per_edit;
+            estimate.cost =
+                model.leaf_cost * leaves +
+                model.top_level_cell_cost * top_level_cells +
+                model.edit_node_cost * nodes_per_edit;
+            estimates.push_back(estimate);
+        }
+
+        return estimates;
+    }
+
+    int
+    suggest_cell_size(cell_size_cost_model const & model = cell_size_cost_model()) const
+    {
+        std::vector<cell_size_estimate> const estimates = estimate(model);
+        return
+            std::min_element
+            (
+                estimates.begin(),
+                estimates.end(),
+                [](cell_size_estimate const & a, cell_size_estimate const & b)
+                {
+                    return a.cost < b.cost;
+                }
+            )->cell_size;
+    }
+
+private:
+    rect_type rect_;
+    int min_cell_size_;
+    int max_cell_size_;
+    int width_in_blocks_;
+    int height_in_blocks_;
+    long long number_of_points_{0};
+    std::vector<unsigned char> blocks_;
+};
+
+template <typename point_range_type_tp>
+int
+suggest_cell_size
+(
+    rect<int> const & rect,
+    point_range_type_tp const & points,
+    cell_size_cost_model const & model = cell_size_cost_model()
+)
+{
+    density_histogram histogram(rect);
+    for (point<int> const & position : points)
+    {
+        histogram.add_point(position);
+    }
+    return histogram.suggest_cell_size(model);
+}
+
+inline int
+suggest_cell_size
+(
+    rect<int> const & rect,
+    unsigned char const * data,
+    int stride,
+    int threshold,
+    cell_size_cost_model const & model = cell_size_cost_model()
+)
+{
+    density_histogram histogram(rect);
+    histogram.add_points(data, stride, threshold);
+    return histogram.suggest_cell_size(model);
+}
+
+}
+}
+
+#endif
@@ -19,16 +19,32 @@
 #define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_COLORIZATION_CONTEXT_HPP
 
 #include <vector>
+#include <memory>
+#include <utility>
 
 #include "types.hpp"
 #include "grid.hpp"
+#include "linear_grid.hpp"
+#include "cell_size.hpp"
 
 namespace lazybrush
 {
 namespace grid_of_quadtrees_colorizer
 {
 
-template <typename scribble_type_tp>
+// If "cell_size_tp" is not dynamic_cell_size the grids have that cell size
+// fixed at compile time (see grid and dispatch_cell_size).
+// "grid_type_tp" is the storage of the grids: grid, or linear_grid, whose
+// leaves take several times less memory.
+// The leaves inside a scribble are marked from several threads, so
+// "contains_point" and "label" must be safe to call concurrently on a const
+// scribble. They must not fill mutable caches without synchronization
+template
+<
+    typename scribble_type_tp,
+    int cell_size_tp = dynamic_cell_size,
+    template <typename, int> class grid_type_tp = grid
+>
 class colorization_context
 {
 public:
@@ -53,11 +69,6 @@ public:
         intensity_max = 255
     };
 
-    struct reference_grid_cell_data_type
-    {
-        intensity_type intensity{intensity_max};
-    };
-
     struct working_grid_cell_data_type
     {
         index_type index{index_undefined};
@@ -66,12 +77,14 @@ public:
         intensity_type intensity{intensity_max};
     };
 
-    using reference_grid_type = grid<reference_grid_cell_data_type>;
-    using reference_grid_cell_type = typename reference_grid_type::cell_type;
-    
-    using working_grid_type = grid<working_grid_cell_data_type>;
+    using working_grid_type = grid_type_tp<working_grid_cell_data_type, cell_size_tp>;
     using working_grid_cell_type = typename working_grid_type::cell_type;
 
+    // The working grid is an overlay of the reference grid, so both of
+    // them share the same cell type
+    using reference_grid_type = working_grid_type;
+    using reference_grid_cell_type = working_grid_cell_type;
+
     using point_type = typename working_grid_type::point_type;
     using rect_type = typename working_grid_type::rect_type;
 
@@ -81,35 +94,102 @@ public:
         intensity_type intensity;
     };
 
+    struct stats_type
+    {
+        grid_stats reference_grid;
+        // Only the memory of the trees modified by the scribbles is
+        // counted, the rest is shared with the reference grid
+        grid_stats working_grid;
+        int scribbles;
+    };
+
     colorization_context() = default;
+    // Copies are cheap forks: the reference grid is shared, and only the
+    // trees of the working grid modified by the scribbles are copied.
+    // A fork can be modified and colorized while the original is used
+    // from another thread
     colorization_context(colorization_context const &) = default;
-    colorization_context(colorization_context &&) = default;
     colorization_context &
     operator=(colorization_context const &) = default;
-    colorization_context &
-    operator=(colorization_context &&) = default;
 
-    colorization_context(rect_type const & rect, int cell_size, std::vector<input_point> const & points)
-        : reference_grid_(rect, cell_size)
-        , working_grid_(rect, cell_size)
+    // The moved-from context is left null, with the shared empty
+    // reference grid, so reference_grid() is still valid
+    colorization_context(colorization_context && other)
+        : reference_grid_(std::exchange(other.reference_grid_, empty_reference_grid()))
+        , working_grid_(std::move(other.working_grid_))
+        , scribbles_(std::move(other.scribbles_))
+    {}
+
+    colorization_context &
+    operator=(colorization_context && other)
     {
-        for (input_point const & point : points)
+        if (this != &other)
         {
-            reference_grid_cell_type * reference_cell = reference_grid_.add_point(point.position);
-            if (reference_cell)
+            reference_grid_ = std::exchange(other.reference_grid_, empty_reference_grid());
+            working_grid_ = std::move(other.working_grid_);
+            scribbles_ = std::move(other.scribbles_);
+        }
+        return *this;
+    }
+
+    // If "cell_size" is automatic_cell_size, a cell size suited
+    // to the density of the points is used. If "balanced" is true the
+    // grids are kept 2:1 balanced (see grid), which bounds the number of
+    // connections of every leaf
+    colorization_context(rect_type const & rect, int cell_size, std::vector<input_point> const & points, bool balanced = false)
+    {
+        std::shared_ptr<reference_grid_type> reference_grid =
+            std::make_shared<reference_grid_type>(rect, resolve_cell_size(rect, cell_size, points), balanced);
+        reference_grid->add_points
+        (
+            points,
+            [](input_point const & point)
             {
-                reference_cell->data().intensity = point.intensity;
+                return point.position;
+            },
+            [](reference_grid_cell_type * cell, input_point const & point)
+            {
+                cell->data().intensity = point.intensity;
             }
-            working_grid_cell_type * working_cell = working_grid_.add_point(point.position);
-            if (working_cell)
+        );
+
+        set_reference_grid(std::move(reference_grid));
+    }
+
+    colorization_context(int x, int y, int width, int height, int cell_size, std::vector<input_point> const & points, bool balanced = false)
+        : colorization_context(rect_type(x, y, width, height), cell_size, points, balanced)
+    {}
+
+    // Build the context directly from a strided 8 bits raster that covers
+    // "rect". Pixels with a value lower than "threshold" are used as points,
+    // with their value as intensity
+    colorization_context(rect_type const & rect, int cell_size, intensity_type const * data, int stride, int threshold, bool balanced = false)
+        : colorization_context(rect, cell_size, threshold_raster{data, rect.width(), rect.height(), stride, threshold}, balanced)
+    {}
+
+    // Build the context directly from a raster (see raster.hpp) that covers
+    // "rect", with the values of its points as intensities. The raster is
+    // read in place, so a preprocessing stage can hand its result over
+    // without writing it to an image or a vector of points first
+    template <typename raster_type_tp>
+    colorization_context(rect_type const & rect, int cell_size, raster_type_tp const & raster, bool balanced = false)
+    {
+        std::shared_ptr<reference_grid_type> reference_grid =
+            std::make_shared<reference_grid_type>(rect, resolve_cell_size(rect, cell_size, raster), balanced);
+        reference_grid->add_raster_points
+        (
+            raster,
+            [](reference_grid_cell_type * cell, intensity_type intensity)
             {
-                working_cell->data().intensity = point.intensity;
+                cell->data().intensity = intensity;
             }
-        }
+        );
+
+        set_reference_grid(std::move(reference_grid));
     }
 
-    colorization_context(int x, int y, int width, int height, int cell_size, std::vector<input_point> const & points)
-        : colorization_context(rect_type(x, y, width, height), cell_size, points)
+    colorization_context(int x, int y, int width, int height, int cell_size, intensity_type const * data, int stride, int threshold, bool balanced = false)
+        : colorization_context(rect_type(x, y, width, height), cell_size, data, stride, threshold, balanced)
     {}
 
     bool
@@ -121,7 +201,7 @@ public:
     reference_grid_type const &
     reference_grid() const
     {
-        return reference_grid_;
+        return *reference_grid_;
     }
 
     working_grid_type const &
@@ -130,6 +210,12 @@ public:
         return working_grid_;
     }
 
+    stats_type
+    stats() const
+    {
+        return stats_type{reference_grid_->stats(), working_grid_.stats(), static_cast<int>(scribbles_.size())};
+    }
+
     std::vector<scribble_type> const &
     scribbles() const
     {
@@ -186,43 +272,70 @@ public:
         insert_cribble(index, scribble);
     }
 
+private:
+    // Never modified after construction, so it can be shared by all the
+    // forks of the context. The working grid is an overlay of it
+    std::shared_ptr<reference_grid_type const> reference_grid_{empty_reference_grid()};
+    working_grid_type working_grid_;
+    std::vector<scribble_type> scribbles_;
+
+    // Reference grid of the null contexts, shared by all of them
+    static std::shared_ptr<reference_grid_type const> const &
+    empty_reference_grid()
+    {
+        static std::shared_ptr<reference_grid_type const> const grid = std::make_shared<reference_grid_type>();
+        return grid;
+    }
+
     void
-    update_neighbors()
+    set_reference_grid(std::shared_ptr<reference_grid_type const> reference_grid)
     {
-        if (is_null())
+        reference_grid_ = std::move(reference_grid);
+        working_grid_ = working_grid_type::overlay(*reference_grid_);
+    }
+
+    static int
+    resolve_cell_size(rect_type const & rect, int cell_size, std::vector<input_point> const & points)
+    {
+        if (cell_size_tp != dynamic_cell_size)
         {
-            return;
+            return cell_size_tp;
         }
-        
-        // We only need to set the top and left neighbors for each cell since the
-        // conections to the bottom/right cells are made by the bottom/right cells,
-        // so true is passed
-        working_grid_.update_neighbors(true);
+        if (cell_size != automatic_cell_size)
+        {
+            return cell_size;
+        }
+        density_histogram histogram(rect);
+        for (input_point const & point : points)
+        {
+            histogram.add_point(point.position);
+        }
+        return histogram.suggest_cell_size();
     }
 
-private:
-    reference_grid_type reference_grid_;
-    working_grid_type working_grid_;
-    std::vector<scribble_type> scribbles_;
+    template <typename raster_type_tp>
+    static int
+    resolve_cell_size(rect_type const & rect, int cell_size, raster_type_tp const & raster)
+    {
+        if (cell_size_tp != dynamic_cell_size)
+        {
+            return cell_size_tp;
+        }
+        if (cell_size != automatic_cell_size)
+        {
+            return cell_size;
+        }
+        density_histogram histogram(rect);
+        histogram.add_raster_points(raster);
+        return histogram.suggest_cell_size();
+    }
 
     void
     clear_working_grid(rect_type const & rect)
     {
-        // Clear
+        // The trees of the working grid are shared with the reference grid
+        // again, so the original points are restored without copying them
         working_grid_.clear(rect);
-
-        // Add the original points from the reference grid
-        reference_grid_.visit_leaves(
-            rect,
-            [this](reference_grid_cell_type * cell) -> bool
-            {
-                if (cell->is_bottom_most_leaf()) {
-                    working_grid_cell_type * new_cell = working_grid_.add_point(cell->center());
-                    new_cell->data().intensity = cell->data().intensity;
-                }
-                return true;
-            }
-        );
     }
 
     void
@@ -245,8 +358,15 @@ private:
             }
 
             // Add the scribble data to the working grid
-            
-            // Add the contour points
+
+            // Make the working grid own the trees that will be modified,
+            // leaving the ones of the reference grid untouched
+            working_grid_.detach(intersected_rect);
+
+            // Add the contour points at once. Adding a point only subdivides
+            // the leaf that contains it, so filtering all of them before
+            // adding any gives the same points as filtering them one by one
+            std::vector<point_type> contour_points;
             for (point_type const & point : scribble.contour_points())
             {
                 // Continue if the point is outside the interest rect
@@ -254,30 +374,39 @@ private:
                 {
                     continue;
                 }
-                // Get the leaf cell at this point
-                working_grid_cell_type * leaf_cell = working_grid_.leaf_cell_at(point);
-                // Continue if the leaf cell's preferred scribble index is greater
-                // than the current scribble index. A scribble with higher priority
-                // was added in this position
-                if (leaf_cell->data().scribble_index > i)
+                contour_points.push_back(point);
+            }
+            // Get the leaf cells at these points. Remove the ones whose leaf
+            // cell's preferred scribble index is greater than the current
+            // scribble index. A scribble with higher priority was added
+            // in that position
+            auto const leaf_cells = working_grid_.leaf_cells_at(contour_points);
+            std::size_t number_of_contour_points = 0;
+            for (std::size_t j = 0; j < contour_points.size(); ++j)
+            {
+                if (leaf_cells[j]->data().scribble_index > i)
                 {
                     continue;
                 }
-                // Add the point
-                working_grid_.add_point(point);
+                contour_points[number_of_contour_points++] = contour_points[j];
             }
-
-            // Mark the cells' preferred scribble with the scribble index
-            working_grid_.visit_leaves(
+            contour_points.resize(number_of_contour_points);
+            working_grid_.add_points(contour_points);
+
+            // Mark the cells' preferred scribble with the scribble index.
+            // Every leaf is marked independently, so the trees are
+            // distributed among several threads, which call
+            // "contains_point" and "label" concurrently (see above)
+            working_grid_.parallel_visit_leaves(
                 adjusted_rect,
-                [&scribble, i](working_grid_cell_type * cell) -> bool
+                [&scribble, i](working_grid_cell_type * cell)
                 {
                     // Return if the cell's preferred scribble index is greater
                     // than the current scribble index. A scribble with higher priority
                     // was added in this position
                     if (cell->data().scribble_index > i)
                     {
-                        return true;
+                        return;
                     }
                     // Set the preferred scribble index if this cell is inside the scribble
                     if (scribble.contains_point(cell->center()))
@@ -285,17 +414,43 @@ private:
                         cell->data().scribble_index = i;
                         cell->data().preferred_label = scribble.label();
                     }
-
-                    return true;
                 }
             );
         }
     }
 
+    // Merges the blank leaves that the scribbles' contour points split and
+    // ended up with the same data, so the number of leaves does not grow
+    // with the edits
+    void
+    compact_working_grid(rect_type const & rect)
+    {
+        working_grid_.compact(
+            rect,
+            [](working_grid_cell_type const * children) -> bool
+            {
+                working_grid_cell_data_type const & data = children[0].data();
+                for (int i = 0; i < 4; ++i)
+                {
+                    working_grid_cell_data_type const & child_data = children[i].data();
+                    if (child_data.intensity != intensity_max ||
+                        child_data.index != data.index ||
+                        child_data.scribble_index != data.scribble_index ||
+                        child_data.preferred_label != data.preferred_label)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        );
+    }
+
     void clear_and_add_scribbles_to_working_grid(rect_type const & rect)
     {
         clear_working_grid(rect);
         add_scribbles_to_working_grid(rect);
+        compact_working_grid(rect);
     }
 };
 
@@ -22,7 +22,6 @@
 #include <utility>
 #include <algorithm>
 #include <iterator>
-#include <unordered_map>
 
 #include "types.hpp"
 #include "colorization_context.hpp"
@@ -121,18 +120,18 @@ template <typename scribble_type_tp>
 using colorization_return_type =
     std::vector<colorization_return_element_type<scribble_type_tp>>;
 
-template <typename scribble_type_tp>
+template <typename scribble_type_tp, int cell_size_tp, template <typename, int> class grid_type_tp>
 colorization_return_type<scribble_type_tp>
 colorize
 (
-    colorization_context<scribble_type_tp> & context,
+    colorization_context<scribble_type_tp, cell_size_tp, grid_type_tp> & context,
     bool use_implicit_label_for_surounding_area = false
 )
 {
     using scribble_type = scribble_type_tp;
     using return_element_type = colorization_return_element_type<scribble_type_tp>;
     using return_type = colorization_return_type<scribble_type_tp>;
-    using context_type = colorization_context<scribble_type_tp>;
+    using context_type = colorization_context<scribble_type_tp, cell_size_tp, grid_type_tp>;
 
     if (context.is_null())
     {
@@ -191,69 +190,35 @@ colorize
         return return_value;
     }
 
-    // The neighbors for each cell must be updated because the topology of
+    // The neighbors are found every time because the topology of
     // the grid might be changed for example by adding a new scribble.
-    context.update_neighbors();
+    // Only the top and left ones are needed since the connections to the
+    // bottom and right leaves are made by those leaves
+    typename context_type::working_grid_type::leaf_adjacency_type const adjacency =
+        context.working_grid().leaf_adjacency(true);
 
     // Make a flat representation of the leaf cells
-    using cell_type = typename context_type::working_grid_cell_type;
     using leaf_type = detail::leaf_type<context_type>;
-    std::vector<leaf_type> leaves;
+    std::vector<leaf_type> leaves(adjacency.size());
 
-    // Copy info from the tree leaves and assign indices
+    // Copy info from the tree leaves and set the border and neighbor info
+    typename context_type::rect_type const & grid_rect = context.working_grid().rect();
+    for (int i = 0; i < adjacency.size(); ++i)
     {
-        std::unordered_map<typename context_type::working_grid_cell_type*, int> indices;
-        context.working_grid().visit_leaves(
-            [&leaves, &indices](cell_type * cell) -> bool
-            {
-                leaf_type leaf;
-                leaf.preferred_label = cell->data().preferred_label;
-                leaf.intensity = cell->data().intensity;
-                leaf.area = cell->size() * cell->size();
-                leaf.surounding_border_size = cell->size();
-                leaves.push_back(leaf);
-                indices.insert({cell, indices.size()});
-                return true;
-            }
-        );
-
-        // Now that the cells have an index we can properly
-        // set the border and neighbor info
-        context.working_grid().visit_border_leaves(
-            [&leaves, &indices](cell_type * cell) -> bool
-            {
-                leaves[indices[cell]].is_border_leaf = true;
-                return true;
-            }
-        );
-
-        context.working_grid().visit_leaves(
-            [&leaves, &indices](cell_type * cell) -> bool
-            {
-                leaf_type & leaf = leaves[indices[cell]];
-                for (cell_type * neighbor_cell : cell->top_leaf_neighbors()) {
-                    leaf.connections.push_back
-                    (
-                        std::pair<int, int>
-                        (
-                            indices[neighbor_cell],
-                            std::min(cell->size(), neighbor_cell->size())
-                        )
-                    );
-                }
-                for (cell_type * neighbor_cell : cell->left_leaf_neighbors()) {
-                    leaf.connections.push_back
-                    (
-                        std::pair<int, int>
-                        (
-                            indices[neighbor_cell],
-                            std::min(cell->size(), neighbor_cell->size())
-                        )
-                    );
-                }
-                return true;
-            }
-        );
+        auto const cell = adjacency.leaf(i);
+        typename context_type::rect_type const & cell_rect = cell->rect();
+        leaf_type & leaf = leaves[i];
+        leaf.preferred_label = cell->data().preferred_label;
+        leaf.intensity = cell->data().intensity;
+        leaf.area = cell->size() * cell->size();
+        leaf.surounding_border_size = cell->size();
+        leaf.is_border_leaf =
+            cell_rect.left() == grid_rect.left() || cell_rect.right() == grid_rect.right() ||
+            cell_rect.top() == grid_rect.top() || cell_rect.bottom() == grid_rect.bottom();
+        for (leaf_neighbor const & neighbor : adjacency.neighbors(i))
+        {
+            leaf.connections.push_back(std::pair<int, int>(neighbor.index, neighbor.border_length));
+        }
     }
 
     // Compute labeling
@@ -274,16 +239,9 @@ colorize
     // construct the vector with associated
     return_type colorization(leaves.size());
 
+    for (int i = 0; i < adjacency.size(); ++i)
     {
-        int i = 0;
-        context.working_grid().visit_leaves(
-            [&computed_labels, &colorization, &i](cell_type * cell) -> bool
-            {
-                colorization[i] = std::pair(cell->rect(), computed_labels[i]);
-                ++i;
-                return true;
-            }
-        );
+        colorization[i] = std::pair(adjacency.leaf(i)->rect(), computed_labels[i]);
     }
 
     return colorization;
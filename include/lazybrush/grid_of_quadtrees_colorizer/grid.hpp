@@ -19,35 +19,146 @@
 #define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_GRID_HPP
 
 #include <vector>
-#include <stack>
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <iterator>
+#include <type_traits>
 
 #include "types.hpp"
 #include "quadtree.hpp"
+#include "node_pool.hpp"
+#include "adjacency.hpp"
+#include "morton.hpp"
+#include "raster.hpp"
+#include "../parallel.hpp"
 
 namespace lazybrush
 {
 namespace grid_of_quadtrees_colorizer
 {
 
-template <typename data_type_tp>
+// Structure and memory usage of a grid (see grid::stats)
+struct grid_stats
+{
+    int top_level_cells{0};
+    // Top level cells whose trees are owned by the grid. In an overlay
+    // grid the trees of the other ones are shared with the base grid
+    int own_top_level_cells{0};
+    long long nodes{0};
+    long long leaves{0};
+    // Number of nodes and leaves at each level, the top level cells
+    // being at level 0
+    std::vector<long long> nodes_per_level;
+    std::vector<long long> leaves_per_level;
+    // Depth of the tree of every top level cell, in row major order.
+    // A tree that is a single leaf has depth 0
+    std::vector<int> tree_depths;
+    int max_tree_depth{0};
+    // Bytes used by the nodes of the trees owned by the grid
+    std::size_t node_bytes{0};
+    // Bytes held by the grid: the node pool, the top level
+    // cells it owns and the vectors of top level cells
+    std::size_t allocated_bytes{0};
+};
+
+// Passing it as the cell size template argument of grid
+// makes the cell size a constructor argument
+constexpr int dynamic_cell_size = 0;
+
+// Below these numbers of top level cells or points per thread, handing the
+// work to the thread pool costs more than doing it in the calling thread
+constexpr int minimum_cells_per_thread = 32;
+constexpr int minimum_points_per_thread = 1 << 12;
+
+// If "cell_size_tp" is not dynamic_cell_size the size of the top level cells
+// is a compile time constant, so the coordinates are turned into top level
+// cells with shifts and the descents from the top level cells, whose depth
+// is known, are unrolled
+template <typename data_type_tp, int cell_size_tp = dynamic_cell_size>
 class grid
 {
+    static_assert
+    (
+        cell_size_tp == dynamic_cell_size ||
+        (cell_size_tp > 0 && cell_size_tp <= 65536 && (cell_size_tp & (cell_size_tp - 1)) == 0),
+        "The cell size must be a power of two not greater than 65536"
+    );
+
 public:
     using data_type = data_type_tp;
     using cell_type = quadtree_node<data_type>;
     using point_type = typename cell_type::point_type;
     using rect_type = typename cell_type::rect_type;
+    using node_pool_type = node_pool<cell_type>;
+    using leaf_adjacency_type = leaf_adjacency_table<cell_type *>;
 
     grid() = default;
-    grid(grid const &) = default;
     grid(grid &&) = default;
+
+    // Deep copy. The nodes of the trees owned by "other" are copied into
+    // the pool of the new grid, while the trees that an overlay grid shares
+    // with its base grid are shared by the copy too
+    grid(grid const & other)
+        : base_cells_(other.base_cells_)
+        , width_in_cells_(other.width_in_cells_)
+        , height_in_cells_(other.height_in_cells_)
+        , cell_size_(other.cell_size_)
+        , rect_(other.rect_)
+        , is_balanced_(other.is_balanced_)
+    {
+        cells_.resize(other.cells_.size());
+        for (int index = 0; index < static_cast<int>(cells_.size()); ++index)
+        {
+            if (!other.is_own_cell(index))
+            {
+                cells_[index] = other.cells_[index];
+                continue;
+            }
+            cell_type * cell = new cell_type;
+            cell->set_rect(other.cells_[index]->rect());
+            copy_cell(cell, other.cells_[index], node_pool_);
+            cells_[index] = cell;
+        }
+    }
+
     grid &
-    operator=(grid const &) = default;
+    operator=(grid const & other)
+    {
+        if (this != &other)
+        {
+            grid copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+
     grid &
-    operator=(grid &&) = default;
+    operator=(grid && other)
+    {
+        if (this != &other)
+        {
+            grid moved(std::move(other));
+            swap(moved);
+        }
+        return *this;
+    }
 
-    grid(rect_type const & rect, int cell_size)
+    // If "balanced" is true the grid keeps its trees 2:1 balanced: after
+    // every insertion the leaves are split until no leaf is more than twice
+    // as big as any of its side neighbors, even across top level cells.
+    // A leaf then has at most two neighbors at each side.
+    // If the cell size is fixed at compile time "cell_size" is ignored
+    grid(rect_type const & rect, int cell_size, bool balanced = false)
+        : is_balanced_(balanced)
     {
+        if (cell_size_tp != dynamic_cell_size)
+        {
+            cell_size = cell_size_tp;
+        }
+
         int width_in_cells = rect.width() / cell_size;
         if (width_in_cells * cell_size != rect.width())
         {
@@ -81,62 +192,146 @@ public:
         cell_size_ = cell_size;
     }
 
-    grid(int x, int y, int width, int height, int cell_ize)
-        : grid(rect_type(x, y, width, height), cell_ize)
+    grid(int x, int y, int width, int height, int cell_ize, bool balanced = false)
+        : grid(rect_type(x, y, width, height), cell_ize, balanced)
     {}
 
     ~grid()
     {
-        for (cell_type * cell : cells_)
+        for (int index = 0; index < static_cast<int>(cells_.size()); ++index)
+        {
+            if (is_own_cell(index))
+            {
+                delete cells_[index];
+            }
+        }
+    }
+
+    // Creates a grid that shares the trees of "base". A shared tree is
+    // copied into the new grid the first time it has to be modified (see
+    // detach) and it is shared again when it is cleared. "base" must not be
+    // modified afterwards and its trees must outlive the new grid
+    static grid
+    overlay(grid const & base)
+    {
+        grid new_grid;
+        new_grid.cells_ = base.cells_;
+        new_grid.base_cells_ = base.cells_;
+        new_grid.width_in_cells_ = base.width_in_cells_;
+        new_grid.height_in_cells_ = base.height_in_cells_;
+        new_grid.cell_size_ = base.cell_size_;
+        new_grid.rect_ = base.rect_;
+        new_grid.is_balanced_ = base.is_balanced_;
+        return new_grid;
+    }
+
+    bool
+    is_overlay() const
+    {
+        return !base_cells_.empty();
+    }
+
+    // Makes this grid own the trees that intersect with the given rect,
+    // copying the shared ones from the base grid
+    void
+    detach(rect_type const & rect)
+    {
+        if (!is_overlay())
+        {
+            return;
+        }
+
+        rect_type cells_rect = rect_to_cells(rect);
+        if (!cells_rect.is_valid())
         {
-            delete cell;
+            return;
+        }
+
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        {
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                detach_cell(y * width_in_cells_ + x);
+            }
         }
     }
 
     grid
     clone() const
     {
-        grid new_grid(rect_, cell_size_);
+        return grid(*this);
+    }
+
+    void
+    swap(grid & other)
+    {
+        std::swap(cells_, other.cells_);
+        std::swap(base_cells_, other.base_cells_);
+        std::swap(node_pool_, other.node_pool_);
+        std::swap(width_in_cells_, other.width_in_cells_);
+        std::swap(height_in_cells_, other.height_in_cells_);
+        std::swap(cell_size_, other.cell_size_);
+        std::swap(rect_, other.rect_);
+        std::swap(is_balanced_, other.is_balanced_);
+    }
+
+    bool
+    is_balanced() const
+    {
+        return is_balanced_;
+    }
+
+    // Counts the nodes of every level and the depth of every tree. The trees
+    // shared with a base grid are counted, but not their memory
+    grid_stats
+    stats() const
+    {
+        grid_stats result;
+        result.top_level_cells = static_cast<int>(cells_.size());
+        result.tree_depths.resize(cells_.size(), 0);
 
-        // Subdivide (this method ensures that the cells siblings are computed)
-        visit_leaves(
-            [&new_grid](cell_type * cell)
+        long long own_nodes = 0;
+        for (int index = 0; index < static_cast<int>(cells_.size()); ++index)
+        {
+            rect_type const cell_rect(index % width_in_cells_, index / width_in_cells_, 1, 1);
+            bool const is_own = is_own_cell(index);
+            for (cell_type * cell : cells_range_type(this, cell_rect))
             {
-                if (cell->size() == 1)
+                int level = 0;
+                while ((cell->size() << level) < cell_size())
                 {
-                    new_grid.add_point(cell->rect().top_left());
+                    ++level;
                 }
-            }
-        );
-
-        // Now that the grids have the same structure, copy the data
-        for (int i = 0; i < cells_.size(); ++i)
-        {
-            std::stack<cell_type *> src_stack;
-            std::stack<cell_type *> dst_stack;
-            src_stack.push(cells_[i]);
-            dst_stack.push(new_grid.cells_[i]);
-
-            while (!src_stack.empty()) {
-                cell_type *src_cell = src_stack.pop();
-                cell_type *dst_cell = dst_stack.pop();
-
-                dst_cell->set_data(src_cell->data());
-
-                if (src_cell->is_subdivided()) {
-                    src_stack.push(src_cell->bottom_right_child());
-                    src_stack.push(src_cell->bottom_left_child());
-                    src_stack.push(src_cell->top_right_child());
-                    src_stack.push(src_cell->top_left_child());
-                    dst_stack.push(dst_cell->bottom_right_child());
-                    dst_stack.push(dst_cell->bottom_left_child());
-                    dst_stack.push(dst_cell->top_right_child());
-                    dst_stack.push(dst_cell->top_left_child());
+                if (level >= static_cast<int>(result.nodes_per_level.size()))
+                {
+                    result.nodes_per_level.resize(level + 1, 0);
+                    result.leaves_per_level.resize(level + 1, 0);
                 }
+                ++result.nodes_per_level[level];
+                if (cell->is_leaf())
+                {
+                    ++result.leaves_per_level[level];
+                    ++result.leaves;
+                }
+                ++result.nodes;
+                if (is_own)
+                {
+                    ++own_nodes;
+                }
+                result.tree_depths[index] = std::max(result.tree_depths[index], level);
+            }
+            if (is_own)
+            {
+                ++result.own_top_level_cells;
             }
+            result.max_tree_depth = std::max(result.max_tree_depth, result.tree_depths[index]);
         }
 
-        return new_grid;
+        result.node_bytes = static_cast<std::size_t>(own_nodes) * sizeof(cell_type);
+        result.allocated_bytes =
+            (node_pool_.capacity() + result.own_top_level_cells) * sizeof(cell_type) +
+            (cells_.capacity() + base_cells_.capacity()) * sizeof(cell_type *);
+        return result;
     }
 
     bool
@@ -146,7 +341,8 @@ public:
     }
 
     // Deletes the cells of the trees that intersect with the given rect
-    // while keeping the top level ones
+    // while keeping the top level ones.
+    // In an overlay grid the trees of the base grid are shared again instead
     void
     clear(rect_type const & rect)
     {
@@ -160,14 +356,24 @@ public:
         {
             for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
             {
-                const int index = y * width_in_cells_ + x;
-                cell_type * cell = cells_[index];
-                clear_cell(cell);
+                clear_cell(y * width_in_cells_ + x);
             }
         }
+
+        if (is_balanced_)
+        {
+            // The trees around the cleared ones might have leaves that
+            // are too small for the leaves of the cleared trees now
+            cells_rect.set_left(cells_rect.left() - 1);
+            cells_rect.set_top(cells_rect.top() - 1);
+            cells_rect.set_right(cells_rect.right() + 1);
+            cells_rect.set_bottom(cells_rect.bottom() + 1);
+            balance(all_cells_rect().intersected(cells_rect));
+        }
     }
 
-    // Deletes all the cells of the trees while keeping the top level ones
+    // Deletes all the cells of the trees while keeping the top level ones.
+    // In an overlay grid the trees of the base grid are shared again instead
     void
     clear()
     {
@@ -175,10 +381,50 @@ public:
         {
             return;
         }
-        for (cell_type * cell : cells_)
+        for (int index = 0; index < static_cast<int>(cells_.size()); ++index)
+        {
+            clear_cell(index);
+        }
+    }
+
+    // Merges back the subdivided cells whose four children are leaves and
+    // "mergeable(children)" returns true for, bottom-up, so the merges
+    // cascade. "children" points to the four children, which are contiguous,
+    // and a merged cell takes the data of the top left one.
+    // Only the trees that intersect with the given rect and are owned by
+    // this grid are compacted, and in a balanced grid the cells that would
+    // become more than twice as big as a neighbor are kept subdivided.
+    // Returns the number of merged cells
+    template <typename predicate_type_tp>
+    int
+    compact(rect_type const & rect, predicate_type_tp mergeable)
+    {
+        rect_type const cells_rect = rect_to_cells(rect);
+        if (!cells_rect.is_valid())
+        {
+            return 0;
+        }
+
+        int number_of_merged_cells = 0;
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
         {
-            clear_cell(cell);
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                int const index = y * width_in_cells_ + x;
+                if (is_own_cell(index))
+                {
+                    number_of_merged_cells += compact_cell(cells_[index], mergeable);
+                }
+            }
         }
+        return number_of_merged_cells;
+    }
+
+    template <typename predicate_type_tp>
+    int
+    compact(predicate_type_tp mergeable)
+    {
+        return compact(rect_, mergeable);
     }
 
     cell_type *
@@ -189,413 +435,1485 @@ public:
             return nullptr;
         }
 
-        point_type p(point.x() - rect_.left(), point.y() - rect_.top());
-        int x = p.x() / cell_size_;
-        int y = p.y() / cell_size_;
-        int index = y * width_in_cells_ + x;
-        return cells_[index];
+        return cells_[top_level_cell_index_at(point)];
+    }
+
+    cell_type *
+    leaf_cell_at(point_type const & point) const
+    {
+        cell_type * cell = top_level_cell_at(point);
+        if (cell)
+        {
+            return descend_to_leaf_from_top_level_cell(cell, point);
+        }
+        return nullptr;
+    }
+
+    // The leaf cells at the given points, or nullptr for the points outside
+    // of the grid. Instead of descending from the root for every point, the
+    // search goes up from the previous leaf to the first cell that contains
+    // the point and down from there, so close consecutive points (as the
+    // pixels of a scanline or a contour) share most of the walk
+    template <typename point_range_type_tp>
+    std::vector<cell_type *>
+    leaf_cells_at(point_range_type_tp const & points) const
+    {
+        std::vector<cell_type *> leaf_cells;
+        cell_type * cell = nullptr;
+        for (point_type const & point : points)
+        {
+            cell_type * leaf_cell = leaf_cell_at(point, cell);
+            leaf_cells.push_back(leaf_cell);
+            if (leaf_cell)
+            {
+                cell = leaf_cell;
+            }
+        }
+        return leaf_cells;
+    }
+
+    // The leaf cells crossed by the scanline "y" from "x0" to "x1", both
+    // included, from left to right. Each one covers the pixels of the
+    // scanline from its left side (or "x0") to its right side (or "x1")
+    std::vector<cell_type *>
+    leaf_run_at(int y, int x0, int x1) const
+    {
+        std::vector<cell_type *> leaf_cells;
+        if (is_null() || y < rect_.top() || y > rect_.bottom())
+        {
+            return leaf_cells;
+        }
+
+        int x = std::max(x0, rect_.left());
+        int const last_x = std::min(x1, rect_.right());
+        cell_type * cell = nullptr;
+        while (x <= last_x)
+        {
+            cell = leaf_cell_at(point_type(x, y), cell);
+            leaf_cells.push_back(cell);
+            x = cell->rect().right() + 1;
+        }
+        return leaf_cells;
+    }
+
+    // In an overlay grid the tree that contains the point is detached first
+    cell_type *
+    add_point(point_type const & point)
+    {
+        cell_type * cell = add_point(point, node_pool_);
+        if (cell && is_balanced_)
+        {
+            // Only the leaves created for this point can be too small
+            // for their neighbors. They are the children of its ancestors
+            std::vector<cell_type *> new_leaves;
+            for (cell_type * parent = cell->parent(); parent; parent = parent->parent())
+            {
+                cell_type * children = parent->top_left_child();
+                for (int i = 0; i < 4; ++i)
+                {
+                    new_leaves.push_back(children + i);
+                }
+            }
+            balance(std::move(new_leaves));
+        }
+        return cell;
+    }
+
+    cell_type *
+    add_point(int x, int y)
+    {
+        return add_point(point_type(x, y));
+    }
+
+    // Add the points of a strided 8 bits raster whose top left pixel lies
+    // at the top left corner of the grid. Pixels with a value lower than
+    // "threshold" are points, and "visitor" is called with the bottom most
+    // leaf created for each one of them and the value of its pixel
+    template <typename visitor_type_tp>
+    void
+    add_points(unsigned char const * data, int width, int height, int stride, int threshold, visitor_type_tp visitor)
+    {
+        add_raster_points(threshold_raster{data, width, height, stride, threshold}, visitor);
+    }
+
+    // Add the points of a raster (see raster.hpp) whose top left pixel lies
+    // at the top left corner of the grid. "visitor" is called with the
+    // bottom most leaf created for each point and the value of its pixel.
+    // Instead of descending from the root for every point, each top level
+    // tree is built bottom-up: the occupancy of every level is reduced from
+    // the raster in one linear pass and then the nodes are created at once.
+    // The rows of top level cells are distributed among several threads, so
+    // "visitor" is called concurrently (but never twice for the same leaf)
+    template <typename raster_type_tp, typename visitor_type_tp>
+    void
+    add_raster_points(raster_type_tp const & raster, visitor_type_tp visitor)
+    {
+        if (is_null())
+        {
+            return;
+        }
+
+        int const width = std::min(raster.width(), rect_.width());
+        int const height = std::min(raster.height(), rect_.height());
+
+        std::mutex node_pool_mutex;
+        parallel_for
+        (
+            0,
+            height_in_cells_,
+            [this, &raster, width, height, &visitor, &node_pool_mutex](int first_row, int last_row)
+            {
+                std::vector<unsigned char> occupancy;
+                visitor_type_tp row_visitor = visitor;
+                node_pool_type row_node_pool;
+                for (int index = first_row * width_in_cells_; index < last_row * width_in_cells_; ++index)
+                {
+                    add_raster_points_to_cell(index, raster, width, height, occupancy, row_node_pool, row_visitor);
+                }
+                std::lock_guard<std::mutex> lock(node_pool_mutex);
+                node_pool_.merge(std::move(row_node_pool));
+            }
+        );
+
+        if (is_balanced_)
+        {
+            balance(all_cells_rect());
+        }
+    }
+
+    // Add the points of a range of point_type
+    template <typename point_range_type_tp>
+    void
+    add_points(point_range_type_tp const & points)
+    {
+        add_points
+        (
+            points,
+            [](point_type const & point)
+            {
+                return point;
+            },
+            [](cell_type *, point_type const &)
+            {}
+        );
+    }
+
+    // Add the points of a range. "position" maps an element of the range to
+    // its point and "visitor" is called with the bottom most leaf created
+    // for each element and the element itself.
+    // Instead of descending from the root for every point, the elements are
+    // bucketed by top level cell and sorted by the morton code of their
+    // point, so the points inside every node are contiguous and each tree is
+    // built in a single descent that visits every node once. Elements with
+    // the same point are visited in the order they have in the range.
+    // The rows of top level cells are distributed among several threads, so
+    // "visitor" is called concurrently (but never for elements of the same
+    // row at the same time)
+    template <typename point_range_type_tp, typename position_function_type_tp, typename visitor_type_tp>
+    void
+    add_points(point_range_type_tp const & points, position_function_type_tp position, visitor_type_tp visitor)
+    {
+        if (is_null())
+        {
+            return;
+        }
+
+        using element_type = typename point_range_type_tp::value_type;
+
+        std::vector<int> cell_offsets(cells_.size() + 1, 0);
+        for (element_type const & element : points)
+        {
+            point_type const point = position(element);
+            if (rect_.contains(point))
+            {
+                ++cell_offsets[top_level_cell_index_at(point) + 1];
+            }
+        }
+        for (std::size_t index = 0; index < cells_.size(); ++index)
+        {
+            cell_offsets[index + 1] += cell_offsets[index];
+        }
+
+        // The morton codes are relative to the top left corner of the top
+        // level cells. The elements keep the order of the range
+        std::vector<point_entry> entries(cell_offsets.back());
+        std::vector<element_type const *> elements;
+        elements.reserve(cell_offsets.back());
+        {
+            std::vector<int> positions(cell_offsets.begin(), cell_offsets.end() - 1);
+            for (element_type const & element : points)
+            {
+                point_type const point = position(element);
+                if (rect_.contains(point))
+                {
+                    int const index = top_level_cell_index_at(point);
+                    point_type const origin = cells_[index]->rect().top_left();
+                    entries[positions[index]++] =
+                        {
+                            morton_encode(point.x() - origin.x(), point.y() - origin.y()),
+                            static_cast<int>(elements.size())
+                        };
+                    elements.push_back(&element);
+                }
+            }
+        }
+
+        auto const top_level_shift = this->top_level_shift();
+
+        // Only the rows that have points are distributed among the threads
+        int begin_row = 0;
+        while (cell_offsets[(begin_row + 1) * width_in_cells_] == 0)
+        {
+            if (++begin_row == height_in_cells_)
+            {
+                return;
+            }
+        }
+        int end_row = height_in_cells_;
+        while (cell_offsets[(end_row - 1) * width_in_cells_] == cell_offsets.back())
+        {
+            --end_row;
+        }
+        int const number_of_threads =
+            std::min(default_number_of_threads(), std::max(1, cell_offsets.back() / minimum_points_per_thread));
+
+        std::mutex node_pool_mutex;
+        parallel_for
+        (
+            begin_row,
+            end_row,
+            [this, &cell_offsets, &entries, &elements, &visitor, &node_pool_mutex, top_level_shift](int first_row, int last_row)
+            {
+                visitor_type_tp row_visitor = visitor;
+                node_pool_type row_node_pool;
+                auto visit_entry =
+                    [&row_visitor, &elements](cell_type * cell, point_entry const & entry)
+                    {
+                        row_visitor(cell, *elements[entry.element]);
+                    };
+                for (int index = first_row * width_in_cells_; index < last_row * width_in_cells_; ++index)
+                {
+                    point_entry * first = entries.data() + cell_offsets[index];
+                    point_entry * last = entries.data() + cell_offsets[index + 1];
+                    if (first == last)
+                    {
+                        continue;
+                    }
+                    if (is_overlay())
+                    {
+                        detach_cell(index, row_node_pool);
+                    }
+                    std::sort
+                    (
+                        first,
+                        last,
+                        [](point_entry const & a, point_entry const & b)
+                        {
+                            return a.code < b.code || (a.code == b.code && a.element < b.element);
+                        }
+                    );
+                    add_sorted_points_to_cell(cells_[index], first, last, top_level_shift, row_node_pool, visit_entry);
+                }
+                std::lock_guard<std::mutex> lock(node_pool_mutex);
+                node_pool_.merge(std::move(row_node_pool));
+            },
+            number_of_threads
+        );
+
+        if (is_balanced_)
+        {
+            // Only the trees that got points can have leaves
+            // too small for their neighbors
+            std::vector<cell_type *> new_leaves;
+            for (int index = begin_row * width_in_cells_; index < end_row * width_in_cells_; ++index)
+            {
+                if (cell_offsets[index] != cell_offsets[index + 1])
+                {
+                    rect_type const cell_rect(index % width_in_cells_, index / width_in_cells_, 1, 1);
+                    for (cell_type * cell : leaves_range_type(this, cell_rect))
+                    {
+                        new_leaves.push_back(cell);
+                    }
+                }
+            }
+            balance(std::move(new_leaves));
+        }
+    }
+
+    // Forward iterator over the cells of a rect of top level cells, in
+    // preorder or only the leaves. It needs no stack since the next
+    // cell is found following the parent pointers
+    template <bool leaves_only_tp>
+    class cell_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = cell_type *;
+        using difference_type = std::ptrdiff_t;
+        using pointer = cell_type * const *;
+        using reference = cell_type * const &;
+
+        cell_iterator() = default;
+
+        cell_iterator(grid const * the_grid, rect_type const & cells_rect)
+            : grid_(the_grid)
+            , cells_rect_(cells_rect)
+            , x_(cells_rect.left())
+            , y_(cells_rect.top())
+        {
+            if (cells_rect_.is_valid())
+            {
+                enter(grid_->cells_[y_ * grid_->width_in_cells_ + x_]);
+            }
+        }
+
+        reference
+        operator*() const
+        {
+            return cell_;
+        }
+
+        cell_iterator &
+        operator++()
+        {
+            if (!leaves_only_tp && cell_->is_subdivided())
+            {
+                cell_ = cell_->top_left_child();
+                return *this;
+            }
+
+            // The children are visited in the order top left, top right,
+            // bottom left and bottom right
+            cell_type * cell = cell_;
+            while (cell_type * parent = cell->parent())
+            {
+                if (cell == parent->top_left_child())
+                {
+                    enter(parent->top_right_child());
+                    return *this;
+                }
+                if (cell == parent->top_right_child())
+                {
+                    enter(parent->bottom_left_child());
+                    return *this;
+                }
+                if (cell == parent->bottom_left_child())
+                {
+                    enter(parent->bottom_right_child());
+                    return *this;
+                }
+                cell = parent;
+            }
+
+            // "cell" is a top level cell, go to the next one
+            if (++x_ > cells_rect_.right())
+            {
+                x_ = cells_rect_.left();
+                if (++y_ > cells_rect_.bottom())
+                {
+                    cell_ = nullptr;
+                    return *this;
+                }
+            }
+            enter(grid_->cells_[y_ * grid_->width_in_cells_ + x_]);
+            return *this;
+        }
+
+        cell_iterator
+        operator++(int)
+        {
+            cell_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+
+        bool
+        operator==(cell_iterator const & other) const
+        {
+            return cell_ == other.cell_;
+        }
+
+        bool
+        operator!=(cell_iterator const & other) const
+        {
+            return cell_ != other.cell_;
+        }
+
+    private:
+        grid const * grid_{nullptr};
+        rect_type cells_rect_;
+        int x_{0};
+        int y_{0};
+        cell_type * cell_{nullptr};
+
+        void
+        enter(cell_type * cell)
+        {
+            if (leaves_only_tp)
+            {
+                while (cell->is_subdivided())
+                {
+                    cell = cell->top_left_child();
+                }
+            }
+            cell_ = cell;
+        }
+    };
+
+    template <bool leaves_only_tp>
+    class cell_range
+    {
+    public:
+        using iterator = cell_iterator<leaves_only_tp>;
+
+        cell_range(grid const * the_grid, rect_type const & cells_rect)
+            : begin_(the_grid, cells_rect)
+        {}
+
+        iterator
+        begin() const
+        {
+            return begin_;
+        }
+
+        iterator
+        end() const
+        {
+            return iterator();
+        }
+
+    private:
+        iterator begin_;
+    };
+
+    using cells_range_type = cell_range<false>;
+    using leaves_range_type = cell_range<true>;
+
+    // All the cells, in preorder
+    cells_range_type
+    cells() const
+    {
+        return cells_range_type(this, all_cells_rect());
+    }
+
+    // The cells of the trees that intersect with the given rect, in preorder
+    cells_range_type
+    cells(rect_type const & rect) const
+    {
+        return cells_range_type(this, rect_to_cells(rect));
+    }
+
+    // All the leaves, in the same order as in visit_leaves
+    leaves_range_type
+    leaves() const
+    {
+        return leaves_range_type(this, all_cells_rect());
+    }
+
+    // The leaves of the trees that intersect with the given rect
+    leaves_range_type
+    leaves(rect_type const & rect) const
+    {
+        return leaves_range_type(this, rect_to_cells(rect));
+    }
+
+    // traverse the cells in preorder
+    template <typename visitor_type_tp>
+    void
+    visit(visitor_type_tp visitor) const
+    {
+        for (cell_type * cell : cells())
+        {
+            if (!visitor(cell))
+            {
+                return;
+            }
+        }
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(visitor_type_tp visitor) const
+    {
+        for (cell_type * cell : leaves())
+        {
+            if (!visitor(cell))
+            {
+                return;
+            }
+        }
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        for (cell_type * cell : cells(rect))
+        {
+            if (!visitor(cell))
+            {
+                return;
+            }
+        }
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        for (cell_type * cell : leaves(rect))
+        {
+            if (!visitor(cell))
+            {
+                return;
+            }
+        }
+    }
+
+    // The following functions visit the cells from several threads. The top
+    // level cells are split in contiguous ranges and every thread visits the
+    // trees of one range with its own copy of "visitor", so the visitor can
+    // keep per thread state without locks. The return value of the visitor
+    // is ignored, every cell is visited.
+    // The variants that take "reduce" combine the copies once all of them
+    // are done, calling "reduce(visitor, std::move(thread_visitor))" in the
+    // order of the ranges, and return the result. Since every copy starts
+    // as "visitor", its state must be the identity of the reduction.
+    // The ranges are jobs of lazybrush::thread_pool, and a rect with few top
+    // level cells, like the ones touched by a scribble, is visited in the
+    // calling thread
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit(visitor_type_tp visitor) const
+    {
+        parallel_visit_cells<false>(all_cells_rect(), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit(visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_cells<false>(all_cells_rect(), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        parallel_visit_cells<false>(rect_to_cells(rect), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit(rect_type const & rect, visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_cells<false>(rect_to_cells(rect), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(visitor_type_tp visitor) const
+    {
+        parallel_visit_cells<true>(all_cells_rect(), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_cells<true>(all_cells_rect(), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        parallel_visit_cells<true>(rect_to_cells(rect), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_cells<true>(rect_to_cells(rect), std::move(visitor), reduce);
+    }
+
+    // Visit all border leaf cells in clockwise direction
+    // starting from the top left one
+    template <typename visitor_type_tp>
+    void
+    visit_border_leaves(visitor_type_tp visitor) const
+    {
+        int index;
+
+        // Top cells
+        for (int x = 0; x < width_in_cells_; ++x) {
+            cell_type * top_level_cell = cells_[x];
+            for (cell_type * cell : top_level_cell->top_most_leaves())
+            {
+                if (!visitor(cell))
+                {
+                    return;
+                }
+            }
+        }
+
+        // Right cells (we must avoid processing again the top right corner cell)
+        index = width_in_cells_ - 1;
+        {
+            cell_type * top_level_cell = cells_[index];
+            std::vector<cell_type *> border_leaf_cells = top_level_cell->right_most_leaves();
+            for (int i = 1; i < border_leaf_cells.size(); ++i)
+            {
+                cell_type * cell = border_leaf_cells[i];
+                if (!visitor(cell))
+                {
+                    return;
+                }
+            }
+            index += width_in_cells_;
+        }
+        for (int y = 1; y < height_in_cells_; ++y, index += width_in_cells_)
+        {
+            cell_type * top_level_cell = cells_[index];
+            for (cell_type * cell : top_level_cell->right_most_leaves())
+            {
+                if (!visitor(cell)) {
+                    return;
+                }
+            }
+        }
+
+        // Bottom cells (we must avoid processing again the bottom right corner cell)
+        index = (height_in_cells_ - 1) * width_in_cells_ + width_in_cells_ - 1;
+        {
+            cell_type * top_level_cell = cells_[index];
+            std::vector<cell_type *> border_leaf_cells = top_level_cell->bottom_most_leaves();
+            for (int i = border_leaf_cells.size() - 2; i >= 0; --i) {
+                cell_type * cell = border_leaf_cells[i];
+                if (!visitor(cell)) {
+                    return;
+                }
+            }
+            --index;
+        }
+        for (int x = width_in_cells_ - 2; x >= 0; --x, --index) {
+            cell_type * top_level_cell = cells_[index];
+            std::vector<cell_type *> border_leaf_cells = top_level_cell->bottom_most_leaves();
+            for (int i = border_leaf_cells.size() - 1; i >= 0; --i) {
+                cell_type * cell = border_leaf_cells[i];
+                if (!visitor(cell)) {
+                    return;
+                }
+            }
+        }
+
+        // Left cells (we must avoid processing again the bottom left corner cell)
+        index = (height_in_cells_ - 1) * width_in_cells_;
+        {
+            cell_type * top_level_cell = cells_[index];
+            std::vector<cell_type *> border_leaf_cells = top_level_cell->left_most_leaves();
+            for (int i = border_leaf_cells.size() - 2; i >= 0; --i) {
+                cell_type * cell = border_leaf_cells[i];
+                if (!visitor(cell)) {
+                    return;
+                }
+            }
+            index -= width_in_cells_;
+        }
+        for (int y = height_in_cells_ - 2; y >= 0; --y, index -= width_in_cells_) {
+            cell_type * top_level_cell = cells_[index];
+            std::vector<cell_type *> border_leaf_cells = top_level_cell->left_most_leaves();
+            for (int i = border_leaf_cells.size() - 1; i >= 0; --i) {
+                cell_type * cell = border_leaf_cells[i];
+                if (!visitor(cell)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    int
+    cell_size() const
+    {
+        return cell_size_tp != dynamic_cell_size ? cell_size_tp : cell_size_;
+    }
+    
+    rect_type const &
+    rect() const
+    {
+        return rect_;
+    }
+    
+    rect_type
+    adjusted_rect(rect_type const & rect) const
+    {
+        if (is_null()) {
+            return rect_type();
+        }
+
+        rect_type adjusted_rect = rect_.intersected(rect);
+        if (!adjusted_rect.is_valid()) {
+            return rect_type();
+        }
+        adjusted_rect.translate(-rect_.left(), -rect_.top());
+        adjusted_rect.set_left(adjusted_rect.left() / cell_size() * cell_size());
+        adjusted_rect.set_top(adjusted_rect.top() / cell_size() * cell_size());
+        adjusted_rect.set_right(adjusted_rect.right() / cell_size() * cell_size() + cell_size() - 1);
+        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size() * cell_size() + cell_size() - 1);
+        return adjusted_rect.translated(rect_.top_left());
+    }
+
+    // Finds the neighbors at each side of every leaf, and the length of the
+    // borders they share, in linear time (see make_leaf_adjacency_table).
+    // The leaves are numbered in the order visit_leaves visits them.
+    // If "find_top_left_neighbors_only" is true only the top and left
+    // neighbors are found, which is enough to know every pair of adjacent
+    // leaves once. In a balanced grid a leaf has at most eight neighbors
+    leaf_adjacency_type
+    leaf_adjacency(bool find_top_left_neighbors_only = false) const
+    {
+        if (is_null())
+        {
+            return leaf_adjacency_type();
+        }
+
+        struct leaf_collector
+        {
+            std::vector<cell_type *> leaf_cells;
+
+            void
+            operator()(cell_type * cell)
+            {
+                leaf_cells.push_back(cell);
+            }
+        };
+
+        // The ranges are reduced in order, so the leaves
+        // keep the order of visit_leaves
+        leaf_collector collector = parallel_visit_leaves
+        (
+            leaf_collector(),
+            [](leaf_collector & result, leaf_collector && other)
+            {
+                result.leaf_cells.insert(result.leaf_cells.end(), other.leaf_cells.begin(), other.leaf_cells.end());
+            }
+        );
+        return make_leaf_adjacency_table(rect_, std::move(collector.leaf_cells), find_top_left_neighbors_only);
+    }
+
+    // Visits the leaves at the given side of the leaf "cell".
+    // First the cell at that side that is at the same level or above in the
+    // tree is found. If it is at the same level, its closest leaves to "cell"
+    // are the neighbors. If it is in a level above, it is already a leaf and
+    // the only neighbor. If there is no such cell, "cell" is in the border
+    template <typename visitor_type_tp>
+    void
+    visit_leaf_neighbors(cell_type * cell, neighbor_side side, visitor_type_tp visitor) const
+    {
+        int const cell_x = (cell->rect().left() - rect_.left()) / cell_size();
+        int const cell_y = (cell->rect().top() - rect_.top()) / cell_size();
+
+        cell_type * side_cell;
+        bool is_same_level;
+        neighbor_side opposite_side;
+        switch (side)
+        {
+        case top_side:
+            is_same_level = find_top_cell(cell, cell_x, cell_y, &side_cell);
+            opposite_side = bottom_side;
+            break;
+        case left_side:
+            is_same_level = find_left_cell(cell, cell_x, cell_y, &side_cell);
+            opposite_side = right_side;
+            break;
+        case bottom_side:
+            is_same_level = find_bottom_cell(cell, cell_x, cell_y, &side_cell);
+            opposite_side = top_side;
+            break;
+        default:
+            is_same_level = find_right_cell(cell, cell_x, cell_y, &side_cell);
+            opposite_side = left_side;
+            break;
+        }
+
+        if (!side_cell)
+        {
+            return;
+        }
+        if (is_same_level)
+        {
+            visit_side_leaves(side_cell, opposite_side, visitor);
+        }
+        else
+        {
+            visitor(side_cell);
+        }
+    }
+
+private:
+    std::vector<cell_type *> cells_;
+    // Top level cells of the base grid, if this is an overlay grid
+    std::vector<cell_type *> base_cells_;
+    // Owner of all the nodes of the trees but the top level ones
+    node_pool_type node_pool_;
+    int width_in_cells_{0};
+    int height_in_cells_{0};
+    int cell_size_{0};
+    rect_type rect_;
+    bool is_balanced_{false};
+
+    int
+    top_level_cell_index_at(point_type const & point) const
+    {
+        int const x = (point.x() - rect_.left()) / cell_size();
+        int const y = (point.y() - rect_.top()) / cell_size();
+        return y * width_in_cells_ + x;
+    }
+
+    bool
+    is_own_cell(int index) const
+    {
+        return !is_overlay() || cells_[index] != base_cells_[index];
+    }
+
+    // The nodes are taken from "pool", which must be merged
+    // into node_pool_ afterwards if it is a different pool
+    cell_type *
+    add_point(point_type const & point, node_pool_type & pool)
+    {
+        if (is_null() || !rect_.contains(point))
+        {
+            return nullptr;
+        }
+
+        int const index = top_level_cell_index_at(point);
+        if (is_overlay())
+        {
+            detach_cell(index, pool);
+        }
+        return add_point_to_top_level_cell(cells_[index], point, pool);
+    }
+
+    // Like quadtree_node::add_point, but when the cell size is fixed the
+    // depth of the tree and the size of the cells at each level are known,
+    // so the descent is a loop with a constant trip count
+    static cell_type *
+    add_point_to_top_level_cell(cell_type * cell, point_type const & point, node_pool_type & pool)
+    {
+        if (cell_size_tp == dynamic_cell_size)
+        {
+            return cell->add_point(point, pool);
+        }
+
+        for (int half_size = cell_size_tp / 2; half_size > 0; half_size /= 2)
+        {
+            if (!cell->is_subdivided())
+            {
+                cell->subdivide(pool.allocate_siblings());
+            }
+            int const quadrant =
+                (point.x() >= cell->rect().left() + half_size ? 1 : 0) |
+                (point.y() >= cell->rect().top() + half_size ? 2 : 0);
+            cell = cell->top_left_child() + (quadrant ^ (quadrant >> 1));
+        }
+        return cell;
+    }
+
+    void
+    detach_cell(int index)
+    {
+        detach_cell(index, node_pool_);
+    }
+
+    void
+    detach_cell(int index, node_pool_type & pool)
+    {
+        if (is_own_cell(index))
+        {
+            return;
+        }
+
+        cell_type * cell = new cell_type;
+        cell->set_rect(base_cells_[index]->rect());
+        copy_cell(cell, base_cells_[index], pool);
+        cells_[index] = cell;
+    }
+
+    rect_type
+    all_cells_rect() const
+    {
+        if (is_null())
+        {
+            return rect_type();
+        }
+        return rect_type(0, 0, width_in_cells_, height_in_cells_);
+    }
+
+    struct no_reduction
+    {
+        template <typename visitor_type_tp>
+        void
+        operator()(visitor_type_tp &, visitor_type_tp &&) const
+        {}
+    };
+
+    template <bool leaves_only_tp, typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_cells(rect_type const & cells_rect, visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        if (!cells_rect.is_valid())
+        {
+            return visitor;
+        }
+
+        // The visitors of the threads, keyed by the first cell of their
+        // range so that they are reduced in a deterministic order
+        std::map<int, visitor_type_tp> thread_visitors;
+        std::mutex thread_visitors_mutex;
+        int const width = cells_rect.width();
+        int const number_of_cells = width * cells_rect.height();
+        int const number_of_threads = std::min(default_number_of_threads(), std::max(1, number_of_cells / minimum_cells_per_thread));
+        parallel_for
+        (
+            0,
+            number_of_cells,
+            [this, &cells_rect, &visitor, &thread_visitors, &thread_visitors_mutex, width](int first, int last)
+            {
+                visitor_type_tp thread_visitor = visitor;
+                for (int i = first; i < last; ++i)
+                {
+                    rect_type const cell_rect(cells_rect.left() + i % width, cells_rect.top() + i / width, 1, 1);
+                    for (cell_type * cell : cell_range<leaves_only_tp>(this, cell_rect))
+                    {
+                        thread_visitor(cell);
+                    }
+                }
+                std::lock_guard<std::mutex> lock(thread_visitors_mutex);
+                thread_visitors.emplace(first, std::move(thread_visitor));
+            },
+            number_of_threads
+        );
+
+        for (auto & thread_visitor : thread_visitors)
+        {
+            reduce(visitor, std::move(thread_visitor.second));
+        }
+        return visitor;
+    }
+
+    rect_type rect_to_cells(rect_type const & rect) const
+    {
+        if (is_null())
+        {
+            return rect_type();
+        }
+
+        rect_type adjusted_rect = rect_.intersected(rect);
+        if (!adjusted_rect.is_valid())
+        {
+            return rect_type();
+        }
+        adjusted_rect.translate(-rect_.left(), -rect_.top());
+        adjusted_rect.set_left(adjusted_rect.left() / cell_size());
+        adjusted_rect.set_top(adjusted_rect.top() / cell_size());
+        adjusted_rect.set_right(adjusted_rect.right() / cell_size());
+        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size());
+        return adjusted_rect;
+    }
+
+    struct point_entry
+    {
+        morton_code_type code;
+        // Index of the element in the input range
+        int element;
+    };
+
+    // Shift of the morton code bits that select the child of a top level
+    // cell. It is a std::integral_constant when the cell size is fixed, so
+    // the shifts of every level of add_sorted_points_to_cell are constants
+    auto
+    top_level_shift() const
+    {
+        if constexpr (cell_size_tp != dynamic_cell_size)
+        {
+            constexpr int shift = 2 * (number_of_levels(cell_size_tp) - 1);
+            return std::integral_constant<int, (shift > 0 ? shift : 0)>();
+        }
+        else
+        {
+            int const shift = 2 * (number_of_levels(cell_size()) - 1);
+            return shift > 0 ? shift : 0;
+        }
     }
 
-    cell_type *
-    leaf_cell_at(point_type const & point) const
+    // Levels of the tree below a cell of size "size"
+    static constexpr int
+    number_of_levels(int size)
     {
-        cell_type * cell = top_level_cell_at(point);
-        if (cell)
+        int levels = 0;
+        while ((1 << levels) < size)
         {
-            return cell->leaf_at(point);
+            ++levels;
         }
-        return nullptr;
+        return levels;
     }
 
-    cell_type *
-    add_point(point_type const & point)
+    // Shift of the children of the cells with "shift". The constant
+    // shifts stop at 0, where the children are the bottom most cells
+    static int
+    child_shift(int shift)
     {
-        cell_type * cell = top_level_cell_at(point);
-        if (cell)
-        {
-            return cell->add_point(point);
-        }
-        return nullptr;
+        return shift - 2;
     }
 
-    cell_type *
-    add_point(int x, int y)
+    template <int shift_tp>
+    static std::integral_constant<int, (shift_tp > 2 ? shift_tp - 2 : 0)>
+    child_shift(std::integral_constant<int, shift_tp>)
     {
-        return add_point(point_type(x, y));
+        return {};
     }
 
-    // traverse the cells in preorder
-    template <typename visitor_type_tp>
-    void
-    visit(visitor_type_tp visitor) const
+    // Adds the points of [first, last), sorted by morton code, to "cell".
+    // "shift" selects the bits of the codes that tell the child of "cell"
+    // a point is in, it is an int or a std::integral_constant (see
+    // top_level_shift). Since the children are in morton order too, the
+    // points of each child are a contiguous subrange
+    template <typename shift_type_tp, typename visit_function_type_tp>
+    static void
+    add_sorted_points_to_cell
+    (
+        cell_type * cell,
+        point_entry const * first,
+        point_entry const * last,
+        shift_type_tp shift,
+        node_pool_type & pool,
+        visit_function_type_tp & visit
+    )
     {
-        if (is_null())
+        if (cell->size() == 1)
         {
+            for (; first != last; ++first)
+            {
+                visit(cell, *first);
+            }
             return;
         }
 
-        for (cell_type * top_level_cell : cells_)
+        if (!cell->is_subdivided())
         {
-            std::stack<cell_type *> stack;
-            stack.push(top_level_cell);
-
-            while (!stack.empty())
-            {
-                cell_type * cell = stack.top();
-                stack.pop();
-                if (!visitor(cell))
-                {
-                    return;
-                };
-                if (cell->is_subdivided())
-                {
-                    stack.push(cell->bottom_right_child());
-                    stack.push(cell->bottom_left_child());
-                    stack.push(cell->top_right_child());
-                    stack.push(cell->top_left_child());
-                }
-            }
+            cell->subdivide(pool.allocate_siblings());
         }
-    }
 
-    template <typename visitor_type_tp>
-    void
-    visit_leaves(visitor_type_tp visitor) const
-    {
-        visit(
-            [visitor](cell_type * cell)
+        cell_type * const children[4]
+        {
+            cell->top_left_child(),
+            cell->top_right_child(),
+            cell->bottom_left_child(),
+            cell->bottom_right_child()
+        };
+        for (int quadrant = 0; quadrant < 4 && first != last; ++quadrant)
+        {
+            point_entry const * quadrant_last =
+                std::partition_point
+                (
+                    first,
+                    last,
+                    [shift, quadrant](point_entry const & entry)
+                    {
+                        return static_cast<int>((entry.code >> shift) & 3) <= quadrant;
+                    }
+                );
+            if (quadrant_last != first)
             {
-                if (cell->is_leaf())
-                {
-                    return(visitor(cell));
-                }
-                return true;
+                add_sorted_points_to_cell(children[quadrant], first, quadrant_last, child_shift(shift), pool, visit);
             }
-        );
+            first = quadrant_last;
+        }
     }
 
-    template <typename visitor_type_tp>
+    // Builds the tree of the top level cell at "index" from the raster.
+    // "occupancy" holds, for every level above the pixels, one byte per node
+    // telling if there is any point inside it. Level "l" has
+    // (cell_size() >> l)^2 entries and the levels are stored one after another.
+    // Only the pixels in [0, raster_width) x [0, raster_height) are read
+    template <typename raster_type_tp, typename visitor_type_tp>
     void
-    visit(rect_type const & rect, visitor_type_tp visitor) const
+    add_raster_points_to_cell
+    (
+        int index,
+        raster_type_tp const & raster,
+        int raster_width,
+        int raster_height,
+        std::vector<unsigned char> & occupancy,
+        node_pool_type & pool,
+        visitor_type_tp & visitor
+    )
     {
-        if (is_null())
+        int const cell_x = (index % width_in_cells_) * cell_size();
+        int const cell_y = (index / width_in_cells_) * cell_size();
+        int const width = std::min(cell_size(), raster_width - cell_x);
+        int const height = std::min(cell_size(), raster_height - cell_y);
+        if (width <= 0 || height <= 0)
         {
             return;
         }
-        
-        rect_type cells_rect = rect_to_cells(rect);
-        if (!cells_rect.is_valid())
+
+        int const levels = number_of_levels(cell_size());
+
+        std::size_t level_offsets[32];
+        std::size_t occupancy_size = 0;
+        for (int level = 1; level <= levels; ++level)
         {
-            return;
+            int const side = cell_size() >> level;
+            level_offsets[level] = occupancy_size;
+            occupancy_size += static_cast<std::size_t>(side) * side;
         }
+        occupancy.assign(occupancy_size, 0);
 
-        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        // Level 1 is reduced directly from the raster
+        if (levels > 0)
         {
-            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            unsigned char * level_1 = occupancy.data();
+            int const side = cell_size() >> 1;
+            for (int y = 0; y < height; ++y)
             {
-                int const index = y * width_in_cells_ + x;
-
-                std::stack<cell_type *> stack;
-                stack.push(cells_[index]);
-
-                while (!stack.empty())
+                unsigned char * row = level_1 + (y >> 1) * side;
+                for (int x = 0; x < width; ++x)
                 {
-                    cell_type * cell = stack.top();
-                    stack.pop();
-                    if (!visitor(cell))
-                    {
-                        return;
-                    };
-                    if (cell->is_subdivided())
-                    {
-                        stack.push(cell->bottom_right_child());
-                        stack.push(cell->bottom_left_child());
-                        stack.push(cell->top_right_child());
-                        stack.push(cell->top_left_child());
-                    }
+                    row[x >> 1] |= raster.is_point(cell_x + x, cell_y + y);
                 }
             }
         }
-    }
 
-    template <typename visitor_type_tp>
-    void
-    visit_leaves(rect_type const & rect, visitor_type_tp visitor) const
-    {
-        visit(
-            rect,
-            [visitor](cell_type * cell)
+        // The upper levels are reduced from the level below
+        for (int level = 2; level <= levels; ++level)
+        {
+            unsigned char const * below = occupancy.data() + level_offsets[level - 1];
+            unsigned char * current = occupancy.data() + level_offsets[level];
+            int const side = cell_size() >> level;
+            int const below_side = side * 2;
+            for (int y = 0; y < side; ++y)
             {
-                if (cell->is_leaf())
+                unsigned char const * top_row = below + 2 * y * below_side;
+                unsigned char const * bottom_row = top_row + below_side;
+                for (int x = 0; x < side; ++x)
                 {
-                    return visitor(cell);
+                    current[y * side + x] =
+                        top_row[2 * x] | top_row[2 * x + 1] |
+                        bottom_row[2 * x] | bottom_row[2 * x + 1];
                 }
-                return true;
             }
-        );
+        }
+
+        raster_cell_builder<raster_type_tp, visitor_type_tp> builder
+        {
+            raster,
+            raster_width,
+            raster_height,
+            cell_size(),
+            cell_x,
+            cell_y,
+            occupancy.data(),
+            level_offsets,
+            pool,
+            visitor
+        };
+        builder.build(cells_[index], levels, 0, 0);
     }
 
-    // Visit all border leaf cells in clockwise direction
-    // starting from the top left one
-    template <typename visitor_type_tp>
-    void
-    visit_border_leaves(visitor_type_tp visitor) const
+    template <typename raster_type_tp, typename visitor_type_tp>
+    struct raster_cell_builder
     {
-        int index;
-
-        // Top cells
-        for (int x = 0; x < width_in_cells_; ++x) {
-            cell_type * top_level_cell = cells_[x];
-            for (cell_type * cell : top_level_cell->top_most_leaves())
+        raster_type_tp const & raster;
+        int raster_width;
+        int raster_height;
+        int cell_size;
+        int cell_x;
+        int cell_y;
+        unsigned char const * occupancy;
+        std::size_t const * level_offsets;
+        node_pool_type & pool;
+        visitor_type_tp & visitor;
+
+        // "x" and "y" are the coordinates of the node among the nodes
+        // of its level in the top level cell
+        void
+        build(cell_type * cell, int level, int x, int y)
+        {
+            if (level == 0)
             {
-                if (!visitor(cell))
+                int const raster_x = cell_x + x;
+                int const raster_y = cell_y + y;
+                if (raster_x >= raster_width || raster_y >= raster_height)
                 {
                     return;
                 }
+                if (raster.is_point(raster_x, raster_y))
+                {
+                    visitor(cell, raster.value(raster_x, raster_y));
+                }
+                return;
             }
-        }
 
-        // Right cells (we must avoid processing again the top right corner cell)
-        index = width_in_cells_ - 1;
-        {
-            cell_type * top_level_cell = cells_[index];
-            std::vector<cell_type *> border_leaf_cells = top_level_cell->right_most_leaves();
-            for (int i = 1; i < border_leaf_cells.size(); ++i)
+            int const side = cell_size >> level;
+            if (!occupancy[level_offsets[level] + y * side + x])
             {
-                cell_type * cell = border_leaf_cells[i];
-                if (!visitor(cell))
-                {
-                    return;
-                }
+                return;
             }
-            index += width_in_cells_;
+
+            cell->subdivide(pool.allocate_siblings());
+            build(cell->top_left_child(), level - 1, 2 * x, 2 * y);
+            build(cell->top_right_child(), level - 1, 2 * x + 1, 2 * y);
+            build(cell->bottom_right_child(), level - 1, 2 * x + 1, 2 * y + 1);
+            build(cell->bottom_left_child(), level - 1, 2 * x, 2 * y + 1);
         }
-        for (int y = 1; y < height_in_cells_; ++y, index += width_in_cells_)
+    };
+
+    // Visit the leaves of "cell" that touch its given side, from left
+    // to right or from top to bottom
+    template <typename visitor_type_tp>
+    static void
+    visit_side_leaves(cell_type * cell, neighbor_side side, visitor_type_tp & visitor)
+    {
+        if (cell->is_leaf())
         {
-            cell_type * top_level_cell = cells_[index];
-            for (cell_type * cell : top_level_cell->right_most_leaves())
-            {
-                if (!visitor(cell)) {
-                    return;
-                }
-            }
+            visitor(cell);
+            return;
         }
 
-        // Bottom cells (we must avoid processing again the bottom right corner cell)
-        index = (height_in_cells_ - 1) * width_in_cells_ + width_in_cells_ - 1;
+        switch (side)
         {
-            cell_type * top_level_cell = cells_[index];
-            std::vector<cell_type *> border_leaf_cells = top_level_cell->bottom_most_leaves();
-            for (int i = border_leaf_cells.size() - 2; i >= 0; --i) {
-                cell_type * cell = border_leaf_cells[i];
-                if (!visitor(cell)) {
-                    return;
-                }
-            }
-            --index;
+        case top_side:
+            visit_side_leaves(cell->top_left_child(), side, visitor);
+            visit_side_leaves(cell->top_right_child(), side, visitor);
+            break;
+        case left_side:
+            visit_side_leaves(cell->top_left_child(), side, visitor);
+            visit_side_leaves(cell->bottom_left_child(), side, visitor);
+            break;
+        case bottom_side:
+            visit_side_leaves(cell->bottom_left_child(), side, visitor);
+            visit_side_leaves(cell->bottom_right_child(), side, visitor);
+            break;
+        default:
+            visit_side_leaves(cell->top_right_child(), side, visitor);
+            visit_side_leaves(cell->bottom_right_child(), side, visitor);
+            break;
         }
-        for (int x = width_in_cells_ - 2; x >= 0; --x, --index) {
-            cell_type * top_level_cell = cells_[index];
-            std::vector<cell_type *> border_leaf_cells = top_level_cell->bottom_most_leaves();
-            for (int i = border_leaf_cells.size() - 1; i >= 0; --i) {
-                cell_type * cell = border_leaf_cells[i];
-                if (!visitor(cell)) {
-                    return;
-                }
-            }
+    }
+
+    // Copy the data and the subdivisions of "source" into the leaf "cell"
+    static void
+    copy_cell(cell_type * cell, cell_type const * source, node_pool_type & pool)
+    {
+        cell->set_data(source->data());
+        if (source->is_subdivided())
+        {
+            cell->subdivide(pool.allocate_siblings());
+            copy_cell(cell->top_left_child(), source->top_left_child(), pool);
+            copy_cell(cell->top_right_child(), source->top_right_child(), pool);
+            copy_cell(cell->bottom_right_child(), source->bottom_right_child(), pool);
+            copy_cell(cell->bottom_left_child(), source->bottom_left_child(), pool);
         }
+    }
 
-        // Left cells (we must avoid processing again the bottom left corner cell)
-        index = (height_in_cells_ - 1) * width_in_cells_;
+    // Leaf cell at "point", found going up from "cell" (if not null) to
+    // the first cell that contains the point and down from there
+    cell_type *
+    leaf_cell_at(point_type const & point, cell_type * cell) const
+    {
+        while (cell && !cell->rect().contains(point))
         {
-            cell_type * top_level_cell = cells_[index];
-            std::vector<cell_type *> border_leaf_cells = top_level_cell->left_most_leaves();
-            for (int i = border_leaf_cells.size() - 2; i >= 0; --i) {
-                cell_type * cell = border_leaf_cells[i];
-                if (!visitor(cell)) {
-                    return;
-                }
-            }
-            index -= width_in_cells_;
+            cell = cell->parent();
         }
-        for (int y = height_in_cells_ - 2; y >= 0; --y, index -= width_in_cells_) {
-            cell_type * top_level_cell = cells_[index];
-            std::vector<cell_type *> border_leaf_cells = top_level_cell->left_most_leaves();
-            for (int i = border_leaf_cells.size() - 1; i >= 0; --i) {
-                cell_type * cell = border_leaf_cells[i];
-                if (!visitor(cell)) {
-                    return;
-                }
-            }
+        if (!cell)
+        {
+            return leaf_cell_at(point);
         }
+        return descend_to_leaf(cell, point);
     }
 
-    int
-    cell_size() const
+    // Like quadtree_node::leaf_at, but without branches to choose the
+    // child. The siblings are contiguous and stored in the order top left,
+    // top right, bottom right and bottom left, so the offset of the child
+    // is the quadrant of the point (its bits tell if it is at the right and
+    // below the center) in gray code
+    static cell_type *
+    descend_to_leaf(cell_type * cell, point_type const & point)
     {
-        return cell_size_;
+        while (cell->is_subdivided())
+        {
+            point_type const center = cell->center();
+            int const quadrant = (point.x() >= center.x() ? 1 : 0) | (point.y() >= center.y() ? 2 : 0);
+            cell = cell->top_left_child() + (quadrant ^ (quadrant >> 1));
+        }
+        return cell;
     }
-    
-    rect_type const &
-    rect() const
+
+    // Like descend_to_leaf, but the depth of the tree and the size of the
+    // cells at each level are known when the cell size is fixed
+    static cell_type *
+    descend_to_leaf_from_top_level_cell(cell_type * cell, point_type const & point)
     {
-        return rect_;
+        if (cell_size_tp == dynamic_cell_size)
+        {
+            return descend_to_leaf(cell, point);
+        }
+
+        for (int half_size = cell_size_tp / 2; half_size > 0; half_size /= 2)
+        {
+            if (!cell->is_subdivided())
+            {
+                break;
+            }
+            int const quadrant =
+                (point.x() >= cell->rect().left() + half_size ? 1 : 0) |
+                (point.y() >= cell->rect().top() + half_size ? 2 : 0);
+            cell = cell->top_left_child() + (quadrant ^ (quadrant >> 1));
+        }
+        return cell;
     }
-    
-    rect_type
-    adjusted_rect(rect_type const & rect) const
+
+    template <typename predicate_type_tp>
+    int
+    compact_cell(cell_type * cell, predicate_type_tp & mergeable)
     {
-        if (is_null()) {
-            return rect_type();
+        if (cell->is_leaf())
+        {
+            return 0;
         }
 
-        rect_type adjusted_rect = rect_.intersected(rect);
-        if (!adjusted_rect.is_valid()) {
-            return rect_type();
+        int number_of_merged_cells = 0;
+        bool children_are_leaves = true;
+        cell_type * children = cell->top_left_child();
+        for (int i = 0; i < 4; ++i)
+        {
+            number_of_merged_cells += compact_cell(children + i, mergeable);
+            children_are_leaves = children_are_leaves && children[i].is_leaf();
         }
-        adjusted_rect.translate(-rect_.left(), -rect_.top());
-        adjusted_rect.set_left(adjusted_rect.left() / cell_size_ * cell_size_);
-        adjusted_rect.set_top(adjusted_rect.top() / cell_size_ * cell_size_);
-        adjusted_rect.set_right(adjusted_rect.right() / cell_size_ * cell_size_ + cell_size_ - 1);
-        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size_ * cell_size_ + cell_size_ - 1);
-        return adjusted_rect.translated(rect_.top_left());
+
+        if (children_are_leaves && mergeable(static_cast<cell_type const *>(children)) &&
+            (!is_balanced_ || is_balanced_if_merged(cell)))
+        {
+            cell->set_data(children[0].data());
+            node_pool_.release_descendants(cell);
+            ++number_of_merged_cells;
+        }
+        return number_of_merged_cells;
     }
 
-    void
-    update_neighbors(bool find_top_left_neighbors_only = false)
+    // Merging "cell" keeps the grid balanced if the leaves at its sides are
+    // at least half its size. Those leaves cover the halves of the sides
+    // completely, so the leaf at one point next to each half is checked
+    bool
+    is_balanced_if_merged(cell_type const * cell) const
     {
-        if (is_null())
+        int const half_size = cell->size() / 2;
+        if (half_size <= 1)
         {
-            return;
+            return true;
         }
 
-        for (int y = 0; y < height_in_cells_; ++y)
+        rect_type const & cell_rect = cell->rect();
+        for (int offset = 0; offset < cell->size(); offset += half_size)
         {
-            for (int x = 0; x < width_in_cells_; ++x)
+            point_type const side_points[number_of_sides]
             {
-                std::stack<cell_type *> stack;
-                const int index = y * width_in_cells_ + x;
-                stack.push(cells_[index]);
-
-                while (!stack.empty())
+                point_type(cell_rect.left() + offset, cell_rect.top() - 1),
+                point_type(cell_rect.left() - 1, cell_rect.top() + offset),
+                point_type(cell_rect.left() + offset, cell_rect.bottom() + 1),
+                point_type(cell_rect.right() + 1, cell_rect.top() + offset)
+            };
+            for (point_type const & side_point : side_points)
+            {
+                cell_type const * side_cell = leaf_cell_at(side_point);
+                if (side_cell && side_cell->size() < half_size)
                 {
-                    cell_type * cell = stack.top();
-                    stack.pop();
-                    if (cell->is_leaf())
-                    {
-                        // Set the neighbor cells in the current cell.
-                        // First: find the cells at each side of the current cell.
-                        // Second:
-                        //     * If the side cell is in the same level, get
-                        //       the closest leaf cells to the current cell
-                        //       and set them as the neighbors.
-                        //     * If the side cell is in a level above the current
-                        //       cell, then use it as the neighbor (since
-                        //       it is already a leaf).
-                        //     * If the side cell is null, then don't set any
-                        //       neighbors at that side
-
-                        cell_type * side_cell;
-                        bool is_same_level;
-                        
-                        is_same_level = find_top_cell(cell, x, y, &side_cell);
-                        if (side_cell)
-                        {
-                            if (is_same_level)
-                            {
-                                cell->set_top_leaf_neighbors(side_cell->bottom_most_leaves());
-                            }
-                            else
-                            {
-                                cell->set_top_leaf_neighbors(std::vector<cell_type *>(1, side_cell));
-                            }
-                        }
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
 
-                        is_same_level = find_left_cell(cell, x, y, &side_cell);
-                        if (side_cell)
-                        {
-                            if (is_same_level)
-                            {
-                                cell->set_left_leaf_neighbors(side_cell->right_most_leaves());
-                            }
-                            else
-                            {
-                                cell->set_left_leaf_neighbors(std::vector<cell_type *>(1, side_cell));
-                            }
-                        }
+    void
+    balance(rect_type const & cells_rect)
+    {
+        std::vector<cell_type *> leaf_cells;
+        for (cell_type * cell : leaves_range_type(this, cells_rect))
+        {
+            leaf_cells.push_back(cell);
+        }
+        balance(std::move(leaf_cells));
+    }
 
-                        if (!find_top_left_neighbors_only) {
-                            is_same_level = find_bottom_cell(cell, x, y, &side_cell);
-                            if (side_cell) {
-                                if (is_same_level) {
-                                    cell->set_bottom_leaf_neighbors(side_cell->top_most_leaves());
-                                }
-                                else
-                                {
-                                    cell->set_bottom_leaf_neighbors(std::vector<cell_type *>(1, side_cell));
-                                }
-                            }
-
-                            is_same_level = find_right_cell(cell, x, y, &side_cell);
-                            if (side_cell) {
-                                if (is_same_level) {
-                                    cell->set_right_leaf_neighbors(side_cell->left_most_leaves());
-                                }
-                                else
-                                {
-                                    cell->set_right_leaf_neighbors(std::vector<cell_type *>(1, side_cell));
-                                }
-                            }
-                        }
+    // Splits the leaves that are more than twice as big as one of the leaves
+    // in "leaf_cells", and then the ones that are too big for the new leaves.
+    // A leaf bigger than its neighbor covers the whole side of it, so the
+    // leaf at any point next to a side is the one to check.
+    // The split leaves pass their data to their children
+    void
+    balance(std::vector<cell_type *> leaf_cells)
+    {
+        while (!leaf_cells.empty())
+        {
+            cell_type * cell = leaf_cells.back();
+            leaf_cells.pop_back();
+            if (cell->is_subdivided())
+            {
+                continue;
+            }
 
+            rect_type const & cell_rect = cell->rect();
+            point_type const side_points[number_of_sides]
+            {
+                point_type(cell_rect.left(), cell_rect.top() - 1),
+                point_type(cell_rect.left() - 1, cell_rect.top()),
+                point_type(cell_rect.left(), cell_rect.bottom() + 1),
+                point_type(cell_rect.right() + 1, cell_rect.top())
+            };
+            for (point_type const & side_point : side_points)
+            {
+                cell_type * side_cell = leaf_cell_at(side_point);
+                while (side_cell && side_cell->size() > 2 * cell->size())
+                {
+                    int const index = top_level_cell_index_at(side_point);
+                    if (is_overlay() && !is_own_cell(index))
+                    {
+                        detach_cell(index);
+                        side_cell = leaf_cell_at(side_point);
                     }
-                    else
+
+                    side_cell->subdivide(node_pool_.allocate_siblings());
+                    cell_type * children = side_cell->top_left_child();
+                    for (int i = 0; i < 4; ++i)
                     {
-                        stack.push(cell->bottom_right_child());
-                        stack.push(cell->bottom_left_child());
-                        stack.push(cell->top_right_child());
-                        stack.push(cell->top_left_child());
+                        children[i].set_data(side_cell->data());
+                        leaf_cells.push_back(children + i);
                     }
+                    side_cell = side_cell->child_at(side_point);
                 }
             }
         }
     }
 
-private:
-    std::vector<cell_type *> cells_;
-    int width_in_cells_, height_in_cells_, cell_size_;
-    rect_type rect_;
-
-    rect_type rect_to_cells(rect_type const & rect) const
+    void clear_cell(int index)
     {
-        if (is_null())
-        {
-            return rect_type();
-        }
-
-        rect_type adjusted_rect = rect_.intersected(rect);
-        if (!adjusted_rect.is_valid())
+        if (is_overlay())
         {
-            return rect_type();
+            if (is_own_cell(index))
+            {
+                node_pool_.release_descendants(cells_[index]);
+                delete cells_[index];
+                cells_[index] = base_cells_[index];
+            }
+            return;
         }
-        adjusted_rect.translate(-rect_.left(), -rect_.top());
-        adjusted_rect.set_left(adjusted_rect.left() / cell_size_);
-        adjusted_rect.set_top(adjusted_rect.top() / cell_size_);
-        adjusted_rect.set_right(adjusted_rect.right() / cell_size_);
-        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size_);
-        return adjusted_rect;
-    }
 
-    void clear_cell(cell_type * cell)
-    {
-        delete cell->top_left_child();
-        delete cell->top_right_child();
-        delete cell->bottom_left_child();
-        delete cell->bottom_right_child();
-        cell->set_top_left_child(nullptr);
-        cell->set_top_right_child(nullptr);
-        cell->set_bottom_left_child(nullptr);
-        cell->set_bottom_right_child(nullptr);
+        cell_type * cell = cells_[index];
+        node_pool_.release_descendants(cell);
         cell->set_data(data_type());
     }
 
@@ -967,7 +2285,7 @@ private:
     // there is no right cell ("cell" is a right border cell).
     // true is returned if the right cell is at the same level.
     // false is returned if the right cell is in a level above or null.
-    bool find_right_cell(cell_type * cell, int cell_x, int cell_y, cell_type ** right_cell)
+    bool find_right_cell(cell_type * cell, int cell_x, int cell_y, cell_type ** right_cell) const
     {
         cell_type * parent = cell->parent();
 
@@ -1063,6 +2381,34 @@ private:
     }
 };
 
+// Calls "function" with std::integral_constant<int, cell_size> if
+// "cell_size" is one of the power of two sizes the grid is usually
+// instantiated with, so it can use a grid with a fixed cell size, or with
+// std::integral_constant<int, dynamic_cell_size> otherwise.
+// Returns what "function" returns, which must be the same for all sizes
+template <typename function_type_tp>
+decltype(auto)
+dispatch_cell_size(int cell_size, function_type_tp function)
+{
+    switch (cell_size)
+    {
+    case 8:
+        return function(std::integral_constant<int, 8>());
+    case 16:
+        return function(std::integral_constant<int, 16>());
+    case 32:
+        return function(std::integral_constant<int, 32>());
+    case 64:
+        return function(std::integral_constant<int, 64>());
+    case 128:
+        return function(std::integral_constant<int, 128>());
+    case 256:
+        return function(std::integral_constant<int, 256>());
+    default:
+        return function(std::integral_constant<int, dynamic_cell_size>());
+    }
+}
+
 }
 }
 
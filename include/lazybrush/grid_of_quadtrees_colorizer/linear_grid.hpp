@@ -0,0 +1,1708 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_LINEAR_GRID_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_LINEAR_GRID_HPP
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "types.hpp"
+#include "morton.hpp"
+#include "adjacency.hpp"
+#include "raster.hpp"
+#include "grid.hpp"
+#include "../parallel.hpp"
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+// Grid of linear quadtrees. Instead of a tree of nodes linked by pointers,
+// every top level cell stores only its leaves, sorted by the morton code of
+// their top left corner (relative to the cell) and with their level (the
+// log2 of their size), so the rect of a leaf is derived from its code.
+// Each leaf takes the size of the code, the level and the data, which is
+// several times smaller than a quadtree_node.
+// The leaves partition the top level cells the same way the leaves of a grid
+// of quadtrees built with the same points do, but they are visited in morton
+// order (top left, top right, bottom left, bottom right).
+// It has the members of grid that colorization_context and colorize use, so
+// it can be their storage instead (see colorization_context). The cells are
+// handles to the leaves: the functions that return cells return handles, and
+// the visitors are called with a pointer to a handle, which can be used like
+// the cell pointers of grid but is only valid during the call.
+// If "cell_size_tp" is not dynamic_cell_size the size of the top level cells
+// is a compile time constant (see grid)
+template <typename data_type_tp, int cell_size_tp = dynamic_cell_size>
+class linear_grid
+{
+    static_assert
+    (
+        cell_size_tp == dynamic_cell_size ||
+        (cell_size_tp > 0 && cell_size_tp <= 65536 && (cell_size_tp & (cell_size_tp - 1)) == 0),
+        "The cell size must be a power of two not greater than 65536"
+    );
+
+public:
+    using data_type = data_type_tp;
+    using point_type = point<int>;
+    using rect_type = lazybrush::grid_of_quadtrees_colorizer::rect<int>;
+
+    struct leaf_type
+    {
+        morton_code_type code{0};
+        std::uint8_t level{0};
+        data_type data;
+    };
+
+    // Light handle to a leaf. It stays valid until a point
+    // is added to its top level cell or the cell is cleared.
+    // "leaf_type_tp" is "leaf_type const" for the handles returned by a
+    // const grid, which only give read access to the data
+    template <typename leaf_type_tp>
+    class basic_cell
+    {
+    public:
+        basic_cell() = default;
+
+        basic_cell(leaf_type_tp * leaf, point_type const & origin)
+            : leaf_(leaf)
+            , origin_(origin)
+        {}
+
+        // A mutable handle converts to a read only one
+        template
+        <
+            typename other_leaf_type_tp,
+            typename = std::enable_if_t<std::is_convertible<other_leaf_type_tp *, leaf_type_tp *>::value>
+        >
+        basic_cell(basic_cell<other_leaf_type_tp> const & other)
+            : leaf_(other.leaf_)
+            , origin_(other.origin_)
+        {}
+
+        bool
+        is_null() const
+        {
+            return leaf_ == nullptr;
+        }
+
+        explicit
+        operator bool() const
+        {
+            return leaf_ != nullptr;
+        }
+
+        // So a handle is used like a cell pointer of grid
+        basic_cell const *
+        operator->() const
+        {
+            return this;
+        }
+
+        auto &
+        data() const
+        {
+            return leaf_->data;
+        }
+
+        int
+        level() const
+        {
+            return leaf_->level;
+        }
+
+        int
+        size() const
+        {
+            return 1 << leaf_->level;
+        }
+
+        rect_type
+        rect() const
+        {
+            return
+                rect_type
+                (
+                    origin_.x() + morton_decode_x(leaf_->code),
+                    origin_.y() + morton_decode_y(leaf_->code),
+                    size(),
+                    size()
+                );
+        }
+
+        point_type
+        center() const
+        {
+            int const size_over_two = size() / 2;
+            return
+                point_type
+                (
+                    origin_.x() + morton_decode_x(leaf_->code) + size_over_two,
+                    origin_.y() + morton_decode_y(leaf_->code) + size_over_two
+                );
+        }
+
+        bool
+        is_bottom_most_leaf() const
+        {
+            return leaf_->level == 0;
+        }
+
+        bool
+        operator==(basic_cell const & other) const
+        {
+            return leaf_ == other.leaf_;
+        }
+
+        bool
+        operator!=(basic_cell const & other) const
+        {
+            return leaf_ != other.leaf_;
+        }
+
+    private:
+        template <typename other_leaf_type_tp>
+        friend class basic_cell;
+
+        leaf_type_tp * leaf_{nullptr};
+        point_type origin_;
+    };
+
+    using cell_type = basic_cell<leaf_type>;
+    using const_cell_type = basic_cell<leaf_type const>;
+    using leaf_adjacency_type = leaf_adjacency_table<const_cell_type>;
+
+    linear_grid() = default;
+    linear_grid(linear_grid &&) = default;
+
+    // Deep copy. The tiles owned by "other" are copied, while the ones
+    // that an overlay grid shares with its base grid are shared by the
+    // copy too
+    linear_grid(linear_grid const & other)
+        : base_tiles_(other.base_tiles_)
+        , width_in_cells_(other.width_in_cells_)
+        , height_in_cells_(other.height_in_cells_)
+        , cell_size_(other.cell_size_)
+        , levels_(other.levels_)
+        , rect_(other.rect_)
+        , is_balanced_(other.is_balanced_)
+    {
+        tiles_.resize(other.tiles_.size());
+        for (int index = 0; index < static_cast<int>(tiles_.size()); ++index)
+        {
+            tiles_[index] = other.is_own_tile(index) ? new tile_type(*other.tiles_[index]) : other.tiles_[index];
+        }
+    }
+
+    linear_grid &
+    operator=(linear_grid const & other)
+    {
+        if (this != &other)
+        {
+            linear_grid copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    linear_grid &
+    operator=(linear_grid && other)
+    {
+        if (this != &other)
+        {
+            linear_grid moved(std::move(other));
+            swap(moved);
+        }
+        return *this;
+    }
+
+    // "cell_size" must be a power of two not greater than 65536.
+    // If "balanced" is true the leaves are kept 2:1 balanced, as in grid.
+    // If the cell size is fixed at compile time "cell_size" is ignored
+    linear_grid(rect_type const & rect, int cell_size, bool balanced = false)
+        : is_balanced_(balanced)
+    {
+        if (cell_size_tp != dynamic_cell_size)
+        {
+            cell_size = cell_size_tp;
+        }
+
+        int width_in_cells = rect.width() / cell_size;
+        if (width_in_cells * cell_size != rect.width())
+        {
+            ++width_in_cells;
+        }
+        int height_in_cells = rect.height() / cell_size;
+        if (height_in_cells * cell_size != rect.height())
+        {
+            ++height_in_cells;
+        }
+
+        rect_ = rect_type(rect.x(), rect.y(), width_in_cells * cell_size, height_in_cells * cell_size);
+        width_in_cells_ = width_in_cells;
+        height_in_cells_ = height_in_cells;
+        cell_size_ = cell_size;
+        levels_ = 0;
+        while ((1 << levels_) < cell_size)
+        {
+            ++levels_;
+        }
+
+        tiles_ = std::vector<tile_type *>(width_in_cells * height_in_cells);
+        for (tile_type *& tile : tiles_)
+        {
+            tile = new tile_type(1, top_level_leaf());
+        }
+    }
+
+    linear_grid(int x, int y, int width, int height, int cell_size, bool balanced = false)
+        : linear_grid(rect_type(x, y, width, height), cell_size, balanced)
+    {}
+
+    ~linear_grid()
+    {
+        for (int index = 0; index < static_cast<int>(tiles_.size()); ++index)
+        {
+            if (is_own_tile(index))
+            {
+                delete tiles_[index];
+            }
+        }
+    }
+
+    // Creates a grid that shares the tiles of "base". A shared tile is
+    // copied into the new grid the first time it has to be modified (see
+    // detach) and it is shared again when it is cleared. "base" must not be
+    // modified afterwards and its tiles must outlive the new grid
+    static linear_grid
+    overlay(linear_grid const & base)
+    {
+        linear_grid new_grid;
+        new_grid.tiles_ = base.tiles_;
+        new_grid.base_tiles_ = base.tiles_;
+        new_grid.width_in_cells_ = base.width_in_cells_;
+        new_grid.height_in_cells_ = base.height_in_cells_;
+        new_grid.cell_size_ = base.cell_size_;
+        new_grid.levels_ = base.levels_;
+        new_grid.rect_ = base.rect_;
+        new_grid.is_balanced_ = base.is_balanced_;
+        return new_grid;
+    }
+
+    bool
+    is_overlay() const
+    {
+        return !base_tiles_.empty();
+    }
+
+    // Makes this grid own the tiles that intersect with the given rect,
+    // copying the shared ones from the base grid
+    void
+    detach(rect_type const & rect)
+    {
+        if (!is_overlay())
+        {
+            return;
+        }
+
+        rect_type cells_rect = rect_to_cells(rect);
+        if (!cells_rect.is_valid())
+        {
+            return;
+        }
+
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        {
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                detach_tile(y * width_in_cells_ + x);
+            }
+        }
+    }
+
+    linear_grid
+    clone() const
+    {
+        return linear_grid(*this);
+    }
+
+    void
+    swap(linear_grid & other)
+    {
+        std::swap(tiles_, other.tiles_);
+        std::swap(base_tiles_, other.base_tiles_);
+        std::swap(width_in_cells_, other.width_in_cells_);
+        std::swap(height_in_cells_, other.height_in_cells_);
+        std::swap(cell_size_, other.cell_size_);
+        std::swap(levels_, other.levels_);
+        std::swap(rect_, other.rect_);
+        std::swap(is_balanced_, other.is_balanced_);
+    }
+
+    bool
+    is_balanced() const
+    {
+        return is_balanced_;
+    }
+
+    // Counts the leaves of every level and the depth of every tree, as
+    // grid::stats does. Only the leaves are stored, so "nodes" counts the
+    // inner nodes they imply but "node_bytes" only counts the leaves
+    grid_stats
+    stats() const
+    {
+        grid_stats result;
+        result.top_level_cells = static_cast<int>(tiles_.size());
+        result.tree_depths.resize(tiles_.size(), 0);
+
+        long long own_leaves = 0;
+        std::size_t own_capacity = 0;
+        for (int index = 0; index < static_cast<int>(tiles_.size()); ++index)
+        {
+            tile_type const & leaves = *tiles_[index];
+            long long leaves_per_level[max_levels + 1] = {};
+            int depth = 0;
+            for (leaf_type const & leaf : leaves)
+            {
+                int const level = levels_ - leaf.level;
+                ++leaves_per_level[level];
+                depth = std::max(depth, level);
+            }
+
+            if (depth >= static_cast<int>(result.nodes_per_level.size()))
+            {
+                result.nodes_per_level.resize(depth + 1, 0);
+                result.leaves_per_level.resize(depth + 1, 0);
+            }
+            // Every node of a level that is not a leaf has four children
+            long long nodes = 1;
+            for (int level = 0; level <= depth; ++level)
+            {
+                result.nodes_per_level[level] += nodes;
+                result.leaves_per_level[level] += leaves_per_level[level];
+                result.nodes += nodes;
+                nodes = 4 * (nodes - leaves_per_level[level]);
+            }
+            result.leaves += static_cast<long long>(leaves.size());
+            result.tree_depths[index] = depth;
+            result.max_tree_depth = std::max(result.max_tree_depth, depth);
+
+            if (is_own_tile(index))
+            {
+                ++result.own_top_level_cells;
+                own_leaves += static_cast<long long>(leaves.size());
+                own_capacity += leaves.capacity();
+            }
+        }
+
+        result.node_bytes = static_cast<std::size_t>(own_leaves) * sizeof(leaf_type);
+        result.allocated_bytes =
+            own_capacity * sizeof(leaf_type) +
+            result.own_top_level_cells * sizeof(tile_type) +
+            (tiles_.capacity() + base_tiles_.capacity()) * sizeof(tile_type *);
+        return result;
+    }
+
+    bool
+    is_null() const
+    {
+        return tiles_.empty();
+    }
+
+    // Makes the top level cells that intersect with the given rect leaves.
+    // In an overlay grid the tiles of the base grid are shared again instead
+    void
+    clear(rect_type const & rect)
+    {
+        rect_type cells_rect = rect_to_cells(rect);
+        if (!cells_rect.is_valid())
+        {
+            return;
+        }
+
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        {
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                clear_tile(y * width_in_cells_ + x);
+            }
+        }
+
+        if (is_balanced_)
+        {
+            // The tiles around the cleared ones might have leaves that
+            // are too small for the leaves of the cleared tiles now
+            cells_rect.set_left(cells_rect.left() - 1);
+            cells_rect.set_top(cells_rect.top() - 1);
+            cells_rect.set_right(cells_rect.right() + 1);
+            cells_rect.set_bottom(cells_rect.bottom() + 1);
+            balance(all_cells_rect().intersected(cells_rect));
+        }
+    }
+
+    // Makes all the top level cells leaves.
+    // In an overlay grid the tiles of the base grid are shared again instead
+    void
+    clear()
+    {
+        for (int index = 0; index < static_cast<int>(tiles_.size()); ++index)
+        {
+            clear_tile(index);
+        }
+    }
+
+    // Merges back the groups of four sibling leaves that "mergeable(children)"
+    // returns true for, bottom-up, so the merges cascade. "children" points to
+    // handles to the four siblings, in morton order, and the merged leaf takes
+    // the data of the top left one.
+    // Only the tiles that intersect with the given rect and are owned by
+    // this grid are compacted, and in a balanced grid the leaves that would
+    // become more than twice as big as a neighbor are kept split.
+    // Returns the number of merged cells
+    template <typename predicate_type_tp>
+    int
+    compact(rect_type const & rect, predicate_type_tp mergeable)
+    {
+        rect_type const cells_rect = rect_to_cells(rect);
+        if (!cells_rect.is_valid())
+        {
+            return 0;
+        }
+
+        int number_of_merged_cells = 0;
+        tile_type merged_leaves;
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        {
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                int const index = y * width_in_cells_ + x;
+                if (is_own_tile(index))
+                {
+                    number_of_merged_cells += compact_tile(index, mergeable, merged_leaves);
+                }
+            }
+        }
+        return number_of_merged_cells;
+    }
+
+    template <typename predicate_type_tp>
+    int
+    compact(predicate_type_tp mergeable)
+    {
+        return compact(rect_, mergeable);
+    }
+
+    cell_type
+    leaf_cell_at(point_type const & point)
+    {
+        return leaf_cell_at(*this, point);
+    }
+
+    const_cell_type
+    leaf_cell_at(point_type const & point) const
+    {
+        return leaf_cell_at(*this, point);
+    }
+
+    cell_type
+    leaf_cell_at(int x, int y)
+    {
+        return leaf_cell_at(point_type(x, y));
+    }
+
+    const_cell_type
+    leaf_cell_at(int x, int y) const
+    {
+        return leaf_cell_at(point_type(x, y));
+    }
+
+    // The leaf cells at the given points, or null handles for the points
+    // outside of the grid. The leaves are only searched for the points
+    // outside of the leaf of the previous point, so close consecutive
+    // points (as the pixels of a contour) are found at once
+    template <typename point_range_type_tp>
+    std::vector<cell_type>
+    leaf_cells_at(point_range_type_tp const & points)
+    {
+        return leaf_cells_at(*this, points);
+    }
+
+    template <typename point_range_type_tp>
+    std::vector<const_cell_type>
+    leaf_cells_at(point_range_type_tp const & points) const
+    {
+        return leaf_cells_at(*this, points);
+    }
+
+    // Splits the leaf that contains "point" until there is
+    // a leaf of size 1 for it, and returns that leaf.
+    // In an overlay grid the tile that contains the point is detached first
+    cell_type
+    add_point(point_type const & point)
+    {
+        if (is_null() || !rect_.contains(point))
+        {
+            return cell_type();
+        }
+
+        int const index = tile_index_at(point);
+        detach_tile(index);
+        point_type const origin = tile_origin(index);
+        tile_type & leaves = *tiles_[index];
+        morton_code_type const code = morton_encode(point.x() - origin.x(), point.y() - origin.y());
+
+        typename tile_type::iterator leaf = find_leaf(leaves, code);
+        int const level = leaf->level;
+        if (level == 0)
+        {
+            return cell_type(&*leaf, origin);
+        }
+
+        // The leaf is replaced by the three siblings of the path to the
+        // point on every level plus the new bottom most leaf. The siblings
+        // that precede the path go before the new leaf and the ones that
+        // follow it go after, so the sequence stays sorted
+        leaf_type new_leaves[3 * max_levels + 1];
+        int const number_of_new_leaves = 3 * level + 1;
+        int front = 0;
+        int back = number_of_new_leaves;
+        morton_code_type node_code = leaf->code;
+        for (int node_level = level; node_level > 0; --node_level)
+        {
+            int const shift = 2 * (node_level - 1);
+            morton_code_type const quarter = static_cast<morton_code_type>(1) << shift;
+            int const quadrant = static_cast<int>((code >> shift) & 3u);
+            for (int i = 0; i < quadrant; ++i)
+            {
+                new_leaves[front].code = node_code + i * quarter;
+                new_leaves[front].level = static_cast<std::uint8_t>(node_level - 1);
+                ++front;
+            }
+            for (int i = 3; i > quadrant; --i)
+            {
+                --back;
+                new_leaves[back].code = node_code + i * quarter;
+                new_leaves[back].level = static_cast<std::uint8_t>(node_level - 1);
+            }
+            node_code += quadrant * quarter;
+        }
+        new_leaves[front].code = node_code;
+        new_leaves[front].level = 0;
+
+        std::ptrdiff_t const position = leaf - leaves.begin();
+        *leaf = new_leaves[0];
+        leaves.insert(leaf + 1, new_leaves + 1, new_leaves + number_of_new_leaves);
+
+        if (is_balanced_)
+        {
+            // Only the leaves created for this point can be too small for
+            // their neighbors. Balancing moves the leaves of the tile, so
+            // the new leaf is searched again
+            std::vector<rect_type> new_leaf_rects;
+            for (int i = 0; i < number_of_new_leaves; ++i)
+            {
+                new_leaf_rects.push_back(cell_type(&new_leaves[i], origin).rect());
+            }
+            balance(std::move(new_leaf_rects));
+            return leaf_cell_at(point);
+        }
+        return cell_type(&leaves[position + front], origin);
+    }
+
+    cell_type
+    add_point(int x, int y)
+    {
+        return add_point(point_type(x, y));
+    }
+
+    // Add the points of a strided 8 bits raster whose top left pixel lies
+    // at the top left corner of the grid. Pixels with a value lower than
+    // "threshold" are points, and "visitor" is called with the bottom most
+    // leaf created for each one of them and the value of its pixel
+    template <typename visitor_type_tp>
+    void
+    add_points(unsigned char const * data, int width, int height, int stride, int threshold, visitor_type_tp visitor)
+    {
+        add_raster_points(threshold_raster{data, width, height, stride, threshold}, visitor);
+    }
+
+    // Add the points of a raster (see raster.hpp) whose top left pixel lies
+    // at the top left corner of the grid. "visitor" is called with the
+    // bottom most leaf created for each point and the value of its pixel.
+    // The points of every tile are gathered and sorted by morton code, and
+    // the tile is rebuilt in one pass as in add_points.
+    // The rows of tiles are distributed among several threads, so
+    // "visitor" is called concurrently (but never twice for the same leaf)
+    template <typename raster_type_tp, typename visitor_type_tp>
+    void
+    add_raster_points(raster_type_tp const & raster, visitor_type_tp visitor)
+    {
+        if (is_null())
+        {
+            return;
+        }
+
+        int const width = std::min(raster.width(), rect_.width());
+        int const height = std::min(raster.height(), rect_.height());
+
+        parallel_for
+        (
+            0,
+            height_in_cells_,
+            [this, &raster, width, height, &visitor](int first_row, int last_row)
+            {
+                visitor_type_tp row_visitor = visitor;
+                std::vector<point_entry> entries;
+                std::vector<int> entry_leaves;
+                tile_type new_leaves;
+                for (int index = first_row * width_in_cells_; index < last_row * width_in_cells_; ++index)
+                {
+                    int const tile_x = (index % width_in_cells_) * cell_size();
+                    int const tile_y = (index / width_in_cells_) * cell_size();
+                    int const tile_width = std::min(cell_size(), width - tile_x);
+                    int const tile_height = std::min(cell_size(), height - tile_y);
+
+                    entries.clear();
+                    for (int y = 0; y < tile_height; ++y)
+                    {
+                        for (int x = 0; x < tile_width; ++x)
+                        {
+                            if (raster.is_point(tile_x + x, tile_y + y))
+                            {
+                                entries.push_back({morton_encode(x, y), 0});
+                            }
+                        }
+                    }
+                    if (entries.empty())
+                    {
+                        continue;
+                    }
+                    std::sort
+                    (
+                        entries.begin(),
+                        entries.end(),
+                        [](point_entry const & a, point_entry const & b)
+                        {
+                            return a.code < b.code;
+                        }
+                    );
+
+                    add_sorted_points_to_tile(index, entries.data(), entries.data() + entries.size(), entry_leaves, new_leaves);
+
+                    tile_type & leaves = *tiles_[index];
+                    point_type const origin = tile_origin(index);
+                    for (std::size_t i = 0; i < entries.size(); ++i)
+                    {
+                        cell_type cell(&leaves[entry_leaves[i]], origin);
+                        int const x = tile_x + morton_decode_x(entries[i].code);
+                        int const y = tile_y + morton_decode_y(entries[i].code);
+                        row_visitor(&cell, raster.value(x, y));
+                    }
+                }
+            }
+        );
+
+        if (is_balanced_)
+        {
+            balance(all_cells_rect());
+        }
+    }
+
+    // Add the points of a range of point_type
+    template <typename point_range_type_tp>
+    void
+    add_points(point_range_type_tp const & points)
+    {
+        add_points
+        (
+            points,
+            [](point_type const & point)
+            {
+                return point;
+            },
+            [](cell_type *, point_type const &)
+            {}
+        );
+    }
+
+    // Add the points of a range. "position" maps an element of the range to
+    // its point and "visitor" is called with the bottom most leaf created
+    // for each element and the element itself.
+    // Instead of splitting a leaf for every point, the elements are bucketed
+    // by tile and sorted by the morton code of their point, and every tile
+    // is rebuilt in a single pass over its leaves. Elements with the same
+    // point are visited in the order they have in the range.
+    // The rows of tiles are distributed among several threads, so
+    // "visitor" is called concurrently (but never for elements of the same
+    // row at the same time)
+    template <typename point_range_type_tp, typename position_function_type_tp, typename visitor_type_tp>
+    void
+    add_points(point_range_type_tp const & points, position_function_type_tp position, visitor_type_tp visitor)
+    {
+        if (is_null())
+        {
+            return;
+        }
+
+        using element_type = typename point_range_type_tp::value_type;
+
+        std::vector<int> tile_offsets(tiles_.size() + 1, 0);
+        for (element_type const & element : points)
+        {
+            point_type const point = position(element);
+            if (rect_.contains(point))
+            {
+                ++tile_offsets[tile_index_at(point) + 1];
+            }
+        }
+        for (std::size_t index = 0; index < tiles_.size(); ++index)
+        {
+            tile_offsets[index + 1] += tile_offsets[index];
+        }
+
+        // The morton codes are relative to the top left corner of the
+        // tiles. The elements keep the order of the range
+        std::vector<point_entry> entries(tile_offsets.back());
+        std::vector<element_type const *> elements;
+        elements.reserve(tile_offsets.back());
+        {
+            std::vector<int> positions(tile_offsets.begin(), tile_offsets.end() - 1);
+            for (element_type const & element : points)
+            {
+                point_type const point = position(element);
+                if (rect_.contains(point))
+                {
+                    int const index = tile_index_at(point);
+                    point_type const origin = tile_origin(index);
+                    entries[positions[index]++] =
+                        {
+                            morton_encode(point.x() - origin.x(), point.y() - origin.y()),
+                            static_cast<int>(elements.size())
+                        };
+                    elements.push_back(&element);
+                }
+            }
+        }
+
+        // Only the rows that have points are distributed among the threads
+        int begin_row = 0;
+        while (tile_offsets[(begin_row + 1) * width_in_cells_] == 0)
+        {
+            if (++begin_row == height_in_cells_)
+            {
+                return;
+            }
+        }
+        int end_row = height_in_cells_;
+        while (tile_offsets[(end_row - 1) * width_in_cells_] == tile_offsets.back())
+        {
+            --end_row;
+        }
+        int const number_of_threads =
+            std::min(default_number_of_threads(), std::max(1, tile_offsets.back() / minimum_points_per_thread));
+
+        parallel_for
+        (
+            begin_row,
+            end_row,
+            [this, &tile_offsets, &entries, &elements, &visitor](int first_row, int last_row)
+            {
+                visitor_type_tp row_visitor = visitor;
+                std::vector<int> entry_leaves;
+                tile_type new_leaves;
+                for (int index = first_row * width_in_cells_; index < last_row * width_in_cells_; ++index)
+                {
+                    point_entry * first = entries.data() + tile_offsets[index];
+                    point_entry * last = entries.data() + tile_offsets[index + 1];
+                    if (first == last)
+                    {
+                        continue;
+                    }
+                    std::sort
+                    (
+                        first,
+                        last,
+                        [](point_entry const & a, point_entry const & b)
+                        {
+                            return a.code < b.code || (a.code == b.code && a.element < b.element);
+                        }
+                    );
+
+                    add_sorted_points_to_tile(index, first, last, entry_leaves, new_leaves);
+
+                    tile_type & leaves = *tiles_[index];
+                    point_type const origin = tile_origin(index);
+                    for (point_entry const * entry = first; entry != last; ++entry)
+                    {
+                        cell_type cell(&leaves[entry_leaves[entry - first]], origin);
+                        row_visitor(&cell, *elements[entry->element]);
+                    }
+                }
+            },
+            number_of_threads
+        );
+
+        if (is_balanced_)
+        {
+            // Only the tiles that got points can have leaves
+            // too small for their neighbors
+            std::vector<rect_type> new_leaf_rects;
+            for (int index = begin_row * width_in_cells_; index < end_row * width_in_cells_; ++index)
+            {
+                if (tile_offsets[index] != tile_offsets[index + 1])
+                {
+                    rect_type const cell_rect(index % width_in_cells_, index / width_in_cells_, 1, 1);
+                    collect_leaf_rects(cell_rect, new_leaf_rects);
+                }
+            }
+            balance(std::move(new_leaf_rects));
+        }
+    }
+
+    // The visitors of a const grid are called with const_cell_type handles.
+    // The visit stops when the visitor returns false
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(visitor_type_tp visitor)
+    {
+        visit_leaves(*this, all_cells_rect(), visitor);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(visitor_type_tp visitor) const
+    {
+        visit_leaves(*this, all_cells_rect(), visitor);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(rect_type const & rect, visitor_type_tp visitor)
+    {
+        visit_leaves(*this, rect_to_cells(rect), visitor);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    visit_leaves(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        visit_leaves(*this, rect_to_cells(rect), visitor);
+    }
+
+    // The following functions visit the leaves from several threads, as the
+    // ones of grid do: every thread visits a contiguous range of tiles with
+    // its own copy of "visitor", and the variants that take "reduce" combine
+    // the copies in the order of the ranges and return the result
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(visitor_type_tp visitor)
+    {
+        parallel_visit_leaves(*this, all_cells_rect(), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(visitor_type_tp visitor) const
+    {
+        parallel_visit_leaves(*this, all_cells_rect(), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(visitor_type_tp visitor, reduce_function_type_tp reduce)
+    {
+        return parallel_visit_leaves(*this, all_cells_rect(), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_leaves(*this, all_cells_rect(), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor)
+    {
+        parallel_visit_leaves(*this, rect_to_cells(rect), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp>
+    void
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor) const
+    {
+        parallel_visit_leaves(*this, rect_to_cells(rect), std::move(visitor), no_reduction());
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor, reduce_function_type_tp reduce)
+    {
+        return parallel_visit_leaves(*this, rect_to_cells(rect), std::move(visitor), reduce);
+    }
+
+    template <typename visitor_type_tp, typename reduce_function_type_tp>
+    visitor_type_tp
+    parallel_visit_leaves(rect_type const & rect, visitor_type_tp visitor, reduce_function_type_tp reduce) const
+    {
+        return parallel_visit_leaves(*this, rect_to_cells(rect), std::move(visitor), reduce);
+    }
+
+    // Finds the neighbors at each side of every leaf, and the length of the
+    // borders they share, as grid::leaf_adjacency does. The leaves are
+    // numbered in the order visit_leaves visits them, and the table holds
+    // read only handles to them
+    leaf_adjacency_type
+    leaf_adjacency(bool find_top_left_neighbors_only = false) const
+    {
+        if (is_null())
+        {
+            return leaf_adjacency_type();
+        }
+
+        struct leaf_collector
+        {
+            std::vector<const_cell_type> leaf_cells;
+
+            void
+            operator()(const_cell_type const * cell)
+            {
+                leaf_cells.push_back(*cell);
+            }
+        };
+
+        // The ranges are reduced in order, so the leaves
+        // keep the order of visit_leaves
+        leaf_collector collector = parallel_visit_leaves
+        (
+            leaf_collector(),
+            [](leaf_collector & result, leaf_collector && other)
+            {
+                result.leaf_cells.insert(result.leaf_cells.end(), other.leaf_cells.begin(), other.leaf_cells.end());
+            }
+        );
+        return make_leaf_adjacency_table(rect_, std::move(collector.leaf_cells), find_top_left_neighbors_only);
+    }
+
+    // Visit the leaves that share an edge with "cell" on the given side,
+    // from left to right or from top to bottom. Each one of them is found
+    // with a binary search on the leaves of its top level cell
+    template <typename visitor_type_tp>
+    void
+    visit_leaf_neighbors(const_cell_type const & cell, neighbor_side side, visitor_type_tp visitor) const
+    {
+        rect_type const cell_rect = cell.rect();
+        bool const horizontal = side == top_side || side == bottom_side;
+        int const fixed_coordinate =
+            side == top_side ? cell_rect.top() - 1 :
+            side == bottom_side ? cell_rect.bottom() + 1 :
+            side == left_side ? cell_rect.left() - 1 :
+            cell_rect.right() + 1;
+        int const first = horizontal ? cell_rect.left() : cell_rect.top();
+        int const last = horizontal ? cell_rect.right() : cell_rect.bottom();
+
+        for (int coordinate = first; coordinate <= last;)
+        {
+            point_type const neighbor_point =
+                horizontal ? point_type(coordinate, fixed_coordinate) : point_type(fixed_coordinate, coordinate);
+            const_cell_type const neighbor = leaf_cell_at(neighbor_point);
+            if (neighbor.is_null())
+            {
+                return;
+            }
+            visitor(&neighbor);
+            rect_type const neighbor_rect = neighbor.rect();
+            coordinate = (horizontal ? neighbor_rect.right() : neighbor_rect.bottom()) + 1;
+        }
+    }
+
+    std::vector<const_cell_type>
+    leaf_neighbors(const_cell_type const & cell, neighbor_side side) const
+    {
+        std::vector<const_cell_type> neighbors;
+        visit_leaf_neighbors(
+            cell,
+            side,
+            [&neighbors](const_cell_type const * neighbor)
+            {
+                neighbors.push_back(*neighbor);
+            }
+        );
+        return neighbors;
+    }
+
+    std::size_t
+    number_of_leaves() const
+    {
+        std::size_t count = 0;
+        for (tile_type const * leaves : tiles_)
+        {
+            count += leaves->size();
+        }
+        return count;
+    }
+
+    int
+    cell_size() const
+    {
+        return cell_size_tp != dynamic_cell_size ? cell_size_tp : cell_size_;
+    }
+
+    rect_type const &
+    rect() const
+    {
+        return rect_;
+    }
+
+    rect_type
+    adjusted_rect(rect_type const & rect) const
+    {
+        if (is_null())
+        {
+            return rect_type();
+        }
+
+        rect_type adjusted_rect = rect_.intersected(rect);
+        if (!adjusted_rect.is_valid())
+        {
+            return rect_type();
+        }
+        adjusted_rect.translate(-rect_.left(), -rect_.top());
+        adjusted_rect.set_left(adjusted_rect.left() / cell_size() * cell_size());
+        adjusted_rect.set_top(adjusted_rect.top() / cell_size() * cell_size());
+        adjusted_rect.set_right(adjusted_rect.right() / cell_size() * cell_size() + cell_size() - 1);
+        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size() * cell_size() + cell_size() - 1);
+        return adjusted_rect.translated(rect_.top_left());
+    }
+
+private:
+    using tile_type = std::vector<leaf_type>;
+
+    // Levels that fit in a morton_code_type
+    static constexpr int max_levels = 16;
+
+    struct point_entry
+    {
+        morton_code_type code;
+        // Index of the element in the input range
+        int element;
+    };
+
+    // A leaf that balance has to split
+    struct leaf_split
+    {
+        int tile;
+        morton_code_type code;
+
+        bool
+        operator<(leaf_split const & other) const
+        {
+            return tile < other.tile || (tile == other.tile && code < other.code);
+        }
+
+        bool
+        operator==(leaf_split const & other) const
+        {
+            return tile == other.tile && code == other.code;
+        }
+    };
+
+    std::vector<tile_type *> tiles_;
+    // Tiles of the base grid, if this is an overlay grid
+    std::vector<tile_type *> base_tiles_;
+    int width_in_cells_{0};
+    int height_in_cells_{0};
+    int cell_size_{0};
+    int levels_{0};
+    rect_type rect_;
+    bool is_balanced_{false};
+
+    int
+    tile_index_at(point_type const & point) const
+    {
+        int const x = (point.x() - rect_.left()) / cell_size();
+        int const y = (point.y() - rect_.top()) / cell_size();
+        return y * width_in_cells_ + x;
+    }
+
+    point_type
+    tile_origin(int index) const
+    {
+        return
+            point_type
+            (
+                rect_.left() + (index % width_in_cells_) * cell_size(),
+                rect_.top() + (index / width_in_cells_) * cell_size()
+            );
+    }
+
+    bool
+    is_own_tile(int index) const
+    {
+        return !is_overlay() || tiles_[index] != base_tiles_[index];
+    }
+
+    void
+    detach_tile(int index)
+    {
+        if (is_own_tile(index))
+        {
+            return;
+        }
+        tiles_[index] = new tile_type(*base_tiles_[index]);
+    }
+
+    leaf_type
+    top_level_leaf() const
+    {
+        leaf_type leaf = leaf_type();
+        leaf.level = static_cast<std::uint8_t>(levels_);
+        return leaf;
+    }
+
+    void
+    clear_tile(int index)
+    {
+        if (is_overlay())
+        {
+            if (is_own_tile(index))
+            {
+                delete tiles_[index];
+                tiles_[index] = base_tiles_[index];
+            }
+            return;
+        }
+
+        tiles_[index]->assign(1, top_level_leaf());
+    }
+
+    // The leaves partition the top level cell, so the one that contains
+    // the position with "code" is the last one that starts at or before it.
+    // "leaves_type_tp" is a vector of leaves, const or not
+    template <typename leaves_type_tp>
+    static auto
+    find_leaf(leaves_type_tp & leaves, morton_code_type code)
+    {
+        auto const leaf =
+            std::upper_bound
+            (
+                leaves.begin(),
+                leaves.end(),
+                code,
+                [](morton_code_type code, leaf_type const & leaf)
+                {
+                    return code < leaf.code;
+                }
+            );
+        return leaf - 1;
+    }
+
+    // The const and non const member functions share these ones, with
+    // "grid_type_tp" being "linear_grid const" or "linear_grid". The
+    // handles they make have the constness of the grid
+    template <typename grid_type_tp>
+    using basic_cell_of = std::conditional_t<std::is_const<grid_type_tp>::value, const_cell_type, cell_type>;
+
+    template <typename grid_type_tp>
+    static basic_cell_of<grid_type_tp>
+    leaf_cell_at(grid_type_tp & grid, point_type const & point)
+    {
+        if (grid.is_null() || !grid.rect_.contains(point))
+        {
+            return basic_cell_of<grid_type_tp>();
+        }
+
+        int const index = grid.tile_index_at(point);
+        point_type const origin = grid.tile_origin(index);
+        morton_code_type const code = morton_encode(point.x() - origin.x(), point.y() - origin.y());
+        return basic_cell_of<grid_type_tp>(&*find_leaf(*grid.tiles_[index], code), origin);
+    }
+
+    template <typename grid_type_tp, typename point_range_type_tp>
+    static std::vector<basic_cell_of<grid_type_tp>>
+    leaf_cells_at(grid_type_tp & grid, point_range_type_tp const & points)
+    {
+        std::vector<basic_cell_of<grid_type_tp>> leaf_cells;
+        basic_cell_of<grid_type_tp> cell;
+        for (point_type const & point : points)
+        {
+            if (!cell || !cell.rect().contains(point))
+            {
+                cell = leaf_cell_at(grid, point);
+            }
+            leaf_cells.push_back(cell);
+        }
+        return leaf_cells;
+    }
+
+    template <typename grid_type_tp, typename visitor_type_tp>
+    static void
+    visit_leaves(grid_type_tp & grid, rect_type const & cells_rect, visitor_type_tp & visitor)
+    {
+        if (!cells_rect.is_valid())
+        {
+            return;
+        }
+
+        for (int y = cells_rect.top(); y <= cells_rect.bottom(); ++y)
+        {
+            for (int x = cells_rect.left(); x <= cells_rect.right(); ++x)
+            {
+                int const index = y * grid.width_in_cells_ + x;
+                point_type const origin = grid.tile_origin(index);
+                for (leaf_type & leaf : *grid.tiles_[index])
+                {
+                    basic_cell_of<grid_type_tp> cell(&leaf, origin);
+                    if (!visitor(&cell))
+                    {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    struct no_reduction
+    {
+        template <typename visitor_type_tp>
+        void
+        operator()(visitor_type_tp &, visitor_type_tp &&) const
+        {}
+    };
+
+    template <typename grid_type_tp, typename visitor_type_tp, typename reduce_function_type_tp>
+    static visitor_type_tp
+    parallel_visit_leaves(grid_type_tp & grid, rect_type const & cells_rect, visitor_type_tp visitor, reduce_function_type_tp reduce)
+    {
+        if (!cells_rect.is_valid())
+        {
+            return visitor;
+        }
+
+        // The visitors of the threads, keyed by the first tile of their
+        // range so that they are reduced in a deterministic order
+        std::map<int, visitor_type_tp> thread_visitors;
+        std::mutex thread_visitors_mutex;
+        int const width = cells_rect.width();
+        int const number_of_cells = width * cells_rect.height();
+        int const number_of_threads = std::min(default_number_of_threads(), std::max(1, number_of_cells / minimum_cells_per_thread));
+        parallel_for
+        (
+            0,
+            number_of_cells,
+            [&grid, &cells_rect, &visitor, &thread_visitors, &thread_visitors_mutex, width](int first, int last)
+            {
+                visitor_type_tp thread_visitor = visitor;
+                for (int i = first; i < last; ++i)
+                {
+                    int const index = (cells_rect.top() + i / width) * grid.width_in_cells_ + cells_rect.left() + i % width;
+                    point_type const origin = grid.tile_origin(index);
+                    for (leaf_type & leaf : *grid.tiles_[index])
+                    {
+                        basic_cell_of<grid_type_tp> cell(&leaf, origin);
+                        thread_visitor(&cell);
+                    }
+                }
+                std::lock_guard<std::mutex> lock(thread_visitors_mutex);
+                thread_visitors.emplace(first, std::move(thread_visitor));
+            },
+            number_of_threads
+        );
+
+        for (auto & thread_visitor : thread_visitors)
+        {
+            reduce(visitor, std::move(thread_visitor.second));
+        }
+        return visitor;
+    }
+
+    // Builds the leaves of a tile once the points of a range sorted by
+    // morton code are added to it
+    struct tile_builder
+    {
+        point_entry const * entries;
+        // Position in "new_leaves" of the bottom most leaf of every entry
+        int * entry_leaves;
+        tile_type & new_leaves;
+
+        // Appends the leaves of the node with "code" and "level" once the
+        // points of [first, last), which are inside of it, are added.
+        // [old_first, old_last) are the leaves of the node before, or an
+        // empty range if the node is a new one, whose leaves are blank.
+        // Like in grid, the children of a split leaf are blank
+        void
+        build
+        (
+            morton_code_type code,
+            int level,
+            point_entry const * first,
+            point_entry const * last,
+            leaf_type const * old_first,
+            leaf_type const * old_last
+        )
+        {
+            if (first == last)
+            {
+                if (old_first == old_last)
+                {
+                    new_leaves.push_back(leaf_type{code, static_cast<std::uint8_t>(level), data_type()});
+                }
+                else
+                {
+                    new_leaves.insert(new_leaves.end(), old_first, old_last);
+                }
+                return;
+            }
+
+            if (level == 0)
+            {
+                for (; first != last; ++first)
+                {
+                    entry_leaves[first - entries] = static_cast<int>(new_leaves.size());
+                }
+                new_leaves.push_back(old_first == old_last ? leaf_type{code, 0, data_type()} : *old_first);
+                return;
+            }
+
+            // A node with a single leaf is that leaf, which is split
+            if (old_last - old_first == 1)
+            {
+                old_first = old_last;
+            }
+
+            // The points and the leaves of each child are contiguous
+            int const shift = 2 * (level - 1);
+            morton_code_type const quarter = static_cast<morton_code_type>(1) << shift;
+            for (int quadrant = 0; quadrant < 4; ++quadrant)
+            {
+                auto const is_up_to_quadrant =
+                    [shift, quadrant](morton_code_type child_code)
+                    {
+                        return static_cast<int>((child_code >> shift) & 3) <= quadrant;
+                    };
+                point_entry const * const quadrant_last =
+                    std::partition_point
+                    (
+                        first,
+                        last,
+                        [&is_up_to_quadrant](point_entry const & entry)
+                        {
+                            return is_up_to_quadrant(entry.code);
+                        }
+                    );
+                leaf_type const * const old_quadrant_last =
+                    std::partition_point
+                    (
+                        old_first,
+                        old_last,
+                        [&is_up_to_quadrant](leaf_type const & leaf)
+                        {
+                            return is_up_to_quadrant(leaf.code);
+                        }
+                    );
+                build(code + quadrant * quarter, level - 1, first, quadrant_last, old_first, old_quadrant_last);
+                first = quadrant_last;
+                old_first = old_quadrant_last;
+            }
+        }
+    };
+
+    // "entry_leaves" is set to the position in the tile of the bottom most
+    // leaf of every point of [first, last), which is sorted by morton code.
+    // In an overlay grid the tile is detached first
+    void
+    add_sorted_points_to_tile
+    (
+        int index,
+        point_entry const * first,
+        point_entry const * last,
+        std::vector<int> & entry_leaves,
+        tile_type & new_leaves
+    )
+    {
+        detach_tile(index);
+        tile_type & leaves = *tiles_[index];
+        entry_leaves.resize(last - first);
+        new_leaves.clear();
+        tile_builder builder{first, entry_leaves.data(), new_leaves};
+        builder.build(0, levels_, first, last, leaves.data(), leaves.data() + leaves.size());
+        leaves.swap(new_leaves);
+    }
+
+    // The leaves are merged into "merged_leaves", which works as a stack:
+    // when its last four leaves are the children of a node they can be
+    // replaced by the node. The tile is not modified until the end, so
+    // is_balanced_if_merged sees the leaves as they were before, which can
+    // only keep more of them split
+    template <typename predicate_type_tp>
+    int
+    compact_tile(int index, predicate_type_tp & mergeable, tile_type & merged_leaves)
+    {
+        tile_type & leaves = *tiles_[index];
+        point_type const origin = tile_origin(index);
+        int number_of_merged_cells = 0;
+        merged_leaves.clear();
+        for (leaf_type const & leaf : leaves)
+        {
+            merged_leaves.push_back(leaf);
+            while (merged_leaves.size() >= 4)
+            {
+                leaf_type * const children = merged_leaves.data() + merged_leaves.size() - 4;
+                int const level = children[0].level;
+                int const shift = 2 * level;
+                morton_code_type const quarter = static_cast<morton_code_type>(1) << shift;
+                bool are_siblings = ((children[0].code >> shift) & 3) == 0;
+                for (int i = 1; i < 4 && are_siblings; ++i)
+                {
+                    are_siblings = children[i].level == level && children[i].code == children[0].code + i * quarter;
+                }
+                if (!are_siblings)
+                {
+                    break;
+                }
+
+                cell_type const child_cells[4]
+                {
+                    cell_type(children, origin),
+                    cell_type(children + 1, origin),
+                    cell_type(children + 2, origin),
+                    cell_type(children + 3, origin)
+                };
+                if (!mergeable(static_cast<cell_type const *>(child_cells)))
+                {
+                    break;
+                }
+                if (is_balanced_ && !is_balanced_if_merged(rect_type(child_cells[0].rect().top_left(), 2 << level, 2 << level)))
+                {
+                    break;
+                }
+
+                children[0].level = static_cast<std::uint8_t>(level + 1);
+                merged_leaves.resize(merged_leaves.size() - 3);
+                ++number_of_merged_cells;
+            }
+        }
+
+        if (number_of_merged_cells > 0)
+        {
+            leaves.swap(merged_leaves);
+        }
+        return number_of_merged_cells;
+    }
+
+    // Merging the leaves of a node keeps the grid balanced if the leaves at
+    // its sides are at least half its size. Those leaves cover the halves of
+    // the sides completely, so the leaf at one point next to each half is
+    // checked
+    bool
+    is_balanced_if_merged(rect_type const & node_rect) const
+    {
+        int const half_size = node_rect.width() / 2;
+        if (half_size <= 1)
+        {
+            return true;
+        }
+
+        for (int offset = 0; offset < node_rect.width(); offset += half_size)
+        {
+            point_type const side_points[number_of_sides]
+            {
+                point_type(node_rect.left() + offset, node_rect.top() - 1),
+                point_type(node_rect.left() - 1, node_rect.top() + offset),
+                point_type(node_rect.left() + offset, node_rect.bottom() + 1),
+                point_type(node_rect.right() + 1, node_rect.top() + offset)
+            };
+            for (point_type const & side_point : side_points)
+            {
+                const_cell_type const side_cell = leaf_cell_at(side_point);
+                if (side_cell && side_cell.size() < half_size)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void
+    collect_leaf_rects(rect_type const & cells_rect, std::vector<rect_type> & leaf_rects) const
+    {
+        auto visitor =
+            [&leaf_rects](const_cell_type const * cell)
+            {
+                leaf_rects.push_back(cell->rect());
+                return true;
+            };
+        visit_leaves(*this, cells_rect, visitor);
+    }
+
+    void
+    balance(rect_type const & cells_rect)
+    {
+        std::vector<rect_type> leaf_rects;
+        collect_leaf_rects(cells_rect, leaf_rects);
+        balance(std::move(leaf_rects));
+    }
+
+    // Splits the leaves that are more than twice as big as one of the leaves
+    // with the rects in "leaf_rects", and then the ones that are too big for
+    // the new leaves, like grid::balance does. Splitting a leaf moves the
+    // ones after it in its tile, so the leaves to split are found for all
+    // the rects first and then every tile is rebuilt in one pass.
+    // The split leaves pass their data to their children
+    void
+    balance(std::vector<rect_type> leaf_rects)
+    {
+        std::vector<leaf_split> splits;
+        std::vector<rect_type> next_leaf_rects;
+        while (!leaf_rects.empty())
+        {
+            splits.clear();
+            next_leaf_rects.clear();
+            for (rect_type const & leaf_rect : leaf_rects)
+            {
+                // A leaf that was split after its rect was added is
+                // checked through the rects of its children
+                const_cell_type const cell = leaf_cell_at(leaf_rect.top_left());
+                if (cell.size() != leaf_rect.width())
+                {
+                    continue;
+                }
+
+                point_type const side_points[number_of_sides]
+                {
+                    point_type(leaf_rect.left(), leaf_rect.top() - 1),
+                    point_type(leaf_rect.left() - 1, leaf_rect.top()),
+                    point_type(leaf_rect.left(), leaf_rect.bottom() + 1),
+                    point_type(leaf_rect.right() + 1, leaf_rect.top())
+                };
+                for (point_type const & side_point : side_points)
+                {
+                    const_cell_type const side_cell = leaf_cell_at(side_point);
+                    if (!side_cell || side_cell.size() <= 2 * cell.size())
+                    {
+                        continue;
+                    }
+
+                    int const index = tile_index_at(side_point);
+                    point_type const origin = tile_origin(index);
+                    rect_type const side_rect = side_cell.rect();
+                    splits.push_back({index, morton_encode(side_rect.left() - origin.x(), side_rect.top() - origin.y())});
+                    // The child next to the leaf might still be too big
+                    if (side_cell.size() > 4 * cell.size())
+                    {
+                        next_leaf_rects.push_back(leaf_rect);
+                    }
+                }
+            }
+
+            std::sort(splits.begin(), splits.end());
+            splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+            for (std::size_t first = 0; first < splits.size();)
+            {
+                std::size_t last = first;
+                while (last < splits.size() && splits[last].tile == splits[first].tile)
+                {
+                    ++last;
+                }
+                split_leaves(splits.data() + first, splits.data() + last, next_leaf_rects);
+                first = last;
+            }
+
+            leaf_rects.swap(next_leaf_rects);
+        }
+    }
+
+    // Splits the leaves of [first, last), which are in the same tile and
+    // sorted, and adds the rects of their children to "leaf_rects".
+    // In an overlay grid the tile is detached first
+    void
+    split_leaves(leaf_split const * first, leaf_split const * last, std::vector<rect_type> & leaf_rects)
+    {
+        int const index = first->tile;
+        detach_tile(index);
+        tile_type & leaves = *tiles_[index];
+        point_type const origin = tile_origin(index);
+        tile_type new_leaves;
+        new_leaves.reserve(leaves.size() + 3 * (last - first));
+        for (leaf_type const & leaf : leaves)
+        {
+            if (first == last || first->code != leaf.code)
+            {
+                new_leaves.push_back(leaf);
+                continue;
+            }
+
+            ++first;
+            int const level = leaf.level - 1;
+            morton_code_type const quarter = static_cast<morton_code_type>(1) << (2 * level);
+            for (int i = 0; i < 4; ++i)
+            {
+                new_leaves.push_back(leaf_type{leaf.code + i * quarter, static_cast<std::uint8_t>(level), leaf.data});
+                leaf_rects.push_back(cell_type(&new_leaves.back(), origin).rect());
+            }
+        }
+        leaves.swap(new_leaves);
+    }
+
+    rect_type
+    all_cells_rect() const
+    {
+        if (is_null())
+        {
+            return rect_type();
+        }
+        return rect_type(0, 0, width_in_cells_, height_in_cells_);
+    }
+
+    rect_type
+    rect_to_cells(rect_type const & rect) const
+    {
+        if (is_null())
+        {
+            return rect_type();
+        }
+
+        rect_type adjusted_rect = rect_.intersected(rect);
+        if (!adjusted_rect.is_valid())
+        {
+            return rect_type();
+        }
+        adjusted_rect.translate(-rect_.left(), -rect_.top());
+        adjusted_rect.set_left(adjusted_rect.left() / cell_size());
+        adjusted_rect.set_top(adjusted_rect.top() / cell_size());
+        adjusted_rect.set_right(adjusted_rect.right() / cell_size());
+        adjusted_rect.set_bottom(adjusted_rect.bottom() / cell_size());
+        return adjusted_rect;
+    }
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,80 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_MORTON_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_MORTON_HPP
+
+#include <cstdint>
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+using morton_code_type = std::uint32_t;
+
+// Spread the lower 16 bits of "value" over the even bits of the result
+inline morton_code_type
+morton_spread_bits(morton_code_type value)
+{
+    value &= 0x0000ffffu;
+    value = (value | (value << 8)) & 0x00ff00ffu;
+    value = (value | (value << 4)) & 0x0f0f0f0fu;
+    value = (value | (value << 2)) & 0x33333333u;
+    value = (value | (value << 1)) & 0x55555555u;
+    return value;
+}
+
+// Inverse of morton_spread_bits
+inline morton_code_type
+morton_compact_bits(morton_code_type value)
+{
+    value &= 0x55555555u;
+    value = (value | (value >> 1)) & 0x33333333u;
+    value = (value | (value >> 2)) & 0x0f0f0f0fu;
+    value = (value | (value >> 4)) & 0x00ff00ffu;
+    value = (value | (value >> 8)) & 0x0000ffffu;
+    return value;
+}
+
+// Interleave the bits of "x" (even bits) and "y" (odd bits), so the four
+// quadrants of a square are ordered top left, top right, bottom left and
+// bottom right. "x" and "y" must fit in 16 bits
+inline morton_code_type
+morton_encode(int x, int y)
+{
+    return
+        morton_spread_bits(static_cast<morton_code_type>(x)) |
+        (morton_spread_bits(static_cast<morton_code_type>(y)) << 1);
+}
+
+inline int
+morton_decode_x(morton_code_type code)
+{
+    return static_cast<int>(morton_compact_bits(code));
+}
+
+inline int
+morton_decode_y(morton_code_type code)
+{
+    return static_cast<int>(morton_compact_bits(code >> 1));
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,144 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_NODE_POOL_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_NODE_POOL_HPP
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+// Allocates quadtree nodes in blocks of four siblings. The blocks are taken
+// from big chunks and the released ones are kept in a free list, so a
+// subdivision is a single allocation, siblings are contiguous in memory and
+// releasing a tree never returns memory to the system.
+// The pool is not thread safe. Threads can fill their own pools and merge
+// them afterwards
+template <typename node_type_tp>
+class node_pool
+{
+public:
+    using node_type = node_type_tp;
+
+    static constexpr int blocks_per_chunk = 256;
+
+    node_pool() = default;
+    node_pool(node_pool const &) = delete;
+    node_pool(node_pool &&) = default;
+    node_pool &
+    operator=(node_pool const &) = delete;
+    node_pool &
+    operator=(node_pool &&) = default;
+
+    // Returns four contiguous nodes. Their contents are the ones they had
+    // when they were released, the caller must reset them
+    node_type *
+    allocate_siblings()
+    {
+        if (free_blocks_.empty())
+        {
+            add_chunk();
+        }
+        node_type * siblings = free_blocks_.back();
+        free_blocks_.pop_back();
+        return siblings;
+    }
+
+    void
+    release_siblings(node_type * siblings)
+    {
+        free_blocks_.push_back(siblings);
+    }
+
+    // Releases all the descendants of "node", which becomes a leaf
+    void
+    release_descendants(node_type * node)
+    {
+        if (!node->is_subdivided())
+        {
+            return;
+        }
+
+        node_type * siblings = node->top_left_child();
+        for (int i = 0; i < 4; ++i)
+        {
+            release_descendants(siblings + i);
+        }
+        release_siblings(siblings);
+
+        node->set_top_left_child(nullptr);
+        node->set_top_right_child(nullptr);
+        node->set_bottom_right_child(nullptr);
+        node->set_bottom_left_child(nullptr);
+    }
+
+    // Takes the memory and the free blocks of "other", which becomes empty.
+    // The nodes allocated from "other" are owned by this pool afterwards
+    void
+    merge(node_pool && other)
+    {
+        chunks_.reserve(chunks_.size() + other.chunks_.size());
+        for (std::unique_ptr<node_type[]> & chunk : other.chunks_)
+        {
+            chunks_.push_back(std::move(chunk));
+        }
+        free_blocks_.insert(free_blocks_.end(), other.free_blocks_.begin(), other.free_blocks_.end());
+        other.chunks_.clear();
+        other.free_blocks_.clear();
+    }
+
+    // Number of nodes currently in use
+    std::size_t
+    size() const
+    {
+        return capacity() - 4 * free_blocks_.size();
+    }
+
+    std::size_t
+    capacity() const
+    {
+        return chunks_.size() * 4 * blocks_per_chunk;
+    }
+
+private:
+    std::vector<std::unique_ptr<node_type[]>> chunks_;
+    std::vector<node_type *> free_blocks_;
+
+    void
+    add_chunk()
+    {
+        chunks_.emplace_back(new node_type[4 * blocks_per_chunk]);
+        node_type * chunk = chunks_.back().get();
+        // Push them in reverse order so that consecutive
+        // allocations get consecutive blocks
+        free_blocks_.reserve(free_blocks_.size() + blocks_per_chunk);
+        for (int i = blocks_per_chunk - 1; i >= 0; --i)
+        {
+            free_blocks_.push_back(chunk + 4 * i);
+        }
+    }
+};
+
+}
+}
+
+#endif
@@ -43,25 +43,16 @@ public:
         : data_(data)
     {}
 
-    ~quadtree_node()
-    {
-        if (is_subdivided())
-        {
-            for (int i = 0; i < 4; ++i)
-            {
-                delete children_[i];
-            }
-        }
-    }
-
     quadtree_node &
     operator=(quadtree_node const &) = default;
     quadtree_node &
     operator=(quadtree_node &&) = default;
 
-    // Add a point to the tree, recursivelly
+    // Add a point to the tree, recursivelly. The new children are taken
+    // from "pool" (see node_pool), which owns them
+    template <typename pool_type_tp>
     quadtree_node *
-    add_point(point_type const & point)
+    add_point(point_type const & point, pool_type_tp & pool)
     {
         if (!rect().contains(point))
         {
@@ -75,35 +66,49 @@ public:
 
         if (!is_subdivided())
         {
-            // Subdivide
-            for (int i = 0; i < 4; ++i)
-            {
-                children_[i] = new quadtree_node;
-                children_[i]->set_parent(this);
-            }
-
-            point_type const center_point = center();
-            int const child_size = size() / 2;
-
-            top_left_child()->set_rect(rect().x(), rect().y(), child_size, child_size);
-            top_right_child()->set_rect(center_point.x(), rect().y(), child_size, child_size);
-            bottom_left_child()->set_rect(rect().x(), center_point.y(), child_size, child_size);
-            bottom_right_child()->set_rect(center_point.x(), center_point.y(), child_size, child_size);
+            subdivide(pool.allocate_siblings());
         }
 
         quadtree_node * child = child_at(point);
         if (child)
         {
-            return child->add_point(point);
+            return child->add_point(point, pool);
         }
 
         return nullptr;
     }
 
+    template <typename pool_type_tp>
     quadtree_node *
-    add_point(int x, int y)
+    add_point(int x, int y, pool_type_tp & pool)
+    {
+        return add_point(point_type(x, y), pool);
+    }
+
+    // Make the four contiguous nodes pointed by "siblings" the children of
+    // this leaf node. They are reset, so they can be reused nodes
+    void
+    subdivide(quadtree_node * siblings)
     {
-        return add_point(point_type(x, y));
+        for (int i = 0; i < 4; ++i)
+        {
+            quadtree_node & child = siblings[i];
+            child.parent_ = this;
+            for (quadtree_node *& grandchild : child.children_)
+            {
+                grandchild = nullptr;
+            }
+            child.data_ = data_type();
+            children_[i] = &child;
+        }
+
+        point_type const center_point = center();
+        int const child_size = size() / 2;
+
+        top_left_child()->set_rect(rect().x(), rect().y(), child_size, child_size);
+        top_right_child()->set_rect(center_point.x(), rect().y(), child_size, child_size);
+        bottom_left_child()->set_rect(rect().x(), center_point.y(), child_size, child_size);
+        bottom_right_child()->set_rect(center_point.x(), center_point.y(), child_size, child_size);
     }
 
     // The following functions are just for convenience
@@ -145,30 +150,6 @@ public:
         return children_;
     }
 
-    std::vector<quadtree_node *> const &
-    top_leaf_neighbors() const
-    {
-        return top_leaf_neighbors_;
-    }
-
-    std::vector<quadtree_node *> const &
-    left_leaf_neighbors() const
-    {
-        return left_leaf_neighbors_;
-    }
-
-    std::vector<quadtree_node *> const &
-    bottom_leaf_neighbors() const
-    {
-        return bottom_leaf_neighbors_;
-    }
-
-    std::vector<quadtree_node *> const &
-    right_leaf_neighbors() const
-    {
-        return right_leaf_neighbors_;
-    }
-
     std::vector<quadtree_node *>
     top_most_leaves() const
     {
@@ -323,30 +304,6 @@ public:
         children_[3] = new_child;
     }
 
-    void
-    set_top_leaf_neighbors(std::vector<quadtree_node *> const & new_top_leaf_neighbors)
-    {
-        top_leaf_neighbors_ = new_top_leaf_neighbors;
-    }
-
-    void
-    set_left_leaf_neighbors(std::vector<quadtree_node*> const & new_left_leaf_neighbors)
-    {
-        left_leaf_neighbors_ = new_left_leaf_neighbors;
-    }
-
-    void
-    set_bottom_leaf_neighbors(std::vector<quadtree_node*> const & new_bottom_leaf_neighbors)
-    {
-        bottom_leaf_neighbors_ = new_bottom_leaf_neighbors;
-    }
-
-    void
-    set_right_leaf_neighbors(std::vector<quadtree_node*> const & new_right_leaf_neighbors)
-    {
-        right_leaf_neighbors_ = new_right_leaf_neighbors;
-    }
-
     void
     set_data(data_type const & new_data)
     {
@@ -504,11 +461,6 @@ private:
     quadtree_node * parent_{nullptr};
     quadtree_node * children_[4]{nullptr};
 
-    std::vector<quadtree_node *> top_leaf_neighbors_;
-    std::vector<quadtree_node *> left_leaf_neighbors_;
-    std::vector<quadtree_node *> bottom_leaf_neighbors_;
-    std::vector<quadtree_node *> right_leaf_neighbors_;
-
     rect_type rect_;
 
     data_type data_;
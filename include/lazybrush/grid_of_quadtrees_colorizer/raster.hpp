@@ -0,0 +1,78 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_RASTER_HPP
+#define LAZYBRUSH_GRID_OF_QUADTREES_COLORIZER_RASTER_HPP
+
+#include <cstddef>
+
+namespace lazybrush
+{
+namespace grid_of_quadtrees_colorizer
+{
+
+// The grids, the density histogram and the colorization context can be
+// built from any raster whose top left pixel lies at the top left corner
+// of their rect. A raster is a type with these const member functions:
+//   int width()
+//   int height()
+//   bool is_point(int x, int y): if the pixel is a point
+//   unsigned char value(int x, int y): intensity of a point
+// They are called from several threads at once.
+// This lets the producer of the points, for example a skeletonization
+// that keeps its result packed in bits, be read directly without
+// converting it to an 8 bits image first
+
+// Strided 8 bits raster whose pixels with a value lower than "threshold"
+// are points, with their value as intensity
+struct threshold_raster
+{
+    unsigned char const * data;
+    int raster_width;
+    int raster_height;
+    int stride;
+    int threshold;
+
+    int
+    width() const
+    {
+        return raster_width;
+    }
+
+    int
+    height() const
+    {
+        return raster_height;
+    }
+
+    unsigned char
+    value(int x, int y) const
+    {
+        return data[static_cast<std::ptrdiff_t>(y) * stride + x];
+    }
+
+    bool
+    is_point(int x, int y) const
+    {
+        return value(x, y) < threshold;
+    }
+};
+
+}
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <utility>
 #include <algorithm>
 #include <iterator>
+#include <limits>
 
 #include <maxflow/graph.h>
 
@@ -0,0 +1,272 @@
+// Copyright (C) 2020 deiflou
+// 
+// This file is part of colorizer.
+// 
+// colorizer is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// colorizer is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with colorizer.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef LAZYBRUSH_PARALLEL_HPP
+#define LAZYBRUSH_PARALLEL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+
+namespace lazybrush
+{
+
+inline int
+default_number_of_threads()
+{
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Threads that are started once and wait for jobs, so the parallel passes
+// do not pay for starting and joining threads on every call.
+// A job is a number of tasks run by the workers and the calling thread,
+// which takes tasks too and returns when all of them are done. The pool
+// runs one job at a time: a job started from another thread while the pool
+// is busy, or from a task of a job, runs its tasks in the calling thread
+class thread_pool
+{
+public:
+    explicit thread_pool(int number_of_workers)
+    {
+        workers_.reserve(number_of_workers);
+        for (int i = 0; i < number_of_workers; ++i)
+        {
+            workers_.emplace_back([this]() { work(); });
+        }
+    }
+
+    thread_pool(thread_pool const &) = delete;
+    thread_pool &
+    operator=(thread_pool const &) = delete;
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        job_available_.notify_all();
+        for (std::thread & worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    // Shared by all the parallel passes of the library, with one worker
+    // less than default_number_of_threads since the calling thread works too
+    static thread_pool &
+    instance()
+    {
+        static thread_pool pool(default_number_of_threads() - 1);
+        return pool;
+    }
+
+    int
+    number_of_workers() const
+    {
+        return static_cast<int>(workers_.size());
+    }
+
+    // Calls "function(i)" for every i in [0, number_of_tasks). If "function"
+    // throws, the exception of the first task that threw is rethrown once
+    // all the tasks are done
+    template <typename function_type_tp>
+    void
+    run(int number_of_tasks, function_type_tp & function)
+    {
+        job current_job;
+        current_job.function = &function;
+        current_job.call =
+            [](void * function, int task)
+            {
+                (*static_cast<function_type_tp *>(function))(task);
+            };
+        current_job.number_of_tasks = number_of_tasks;
+
+        std::unique_lock<std::mutex> submit_lock(submit_mutex_, std::defer_lock);
+        if (is_running_task() || workers_.empty() || number_of_tasks == 1 || !submit_lock.try_lock())
+        {
+            run_tasks(current_job);
+            rethrow(current_job);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &current_job;
+            ++generation_;
+        }
+        job_available_.notify_all();
+
+        run_tasks(current_job);
+
+        // The job lives in this stack frame, so wait for the workers that
+        // took it before returning
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_ = nullptr;
+            job_done_.wait(lock, [this]() { return workers_in_job_ == 0; });
+        }
+        rethrow(current_job);
+    }
+
+private:
+    struct job
+    {
+        void (* call)(void *, int);
+        void * function;
+        int number_of_tasks;
+        std::atomic<int> next_task{0};
+        std::mutex exception_mutex;
+        int exception_task{0};
+        std::exception_ptr exception;
+    };
+
+    std::vector<std::thread> workers_;
+    // Serializes the jobs
+    std::mutex submit_mutex_;
+    // Guards the members below
+    std::mutex mutex_;
+    std::condition_variable job_available_;
+    std::condition_variable job_done_;
+    job * job_{nullptr};
+    unsigned long long generation_{0};
+    int workers_in_job_{0};
+    bool stop_{false};
+
+    static bool &
+    is_running_task()
+    {
+        static thread_local bool running_task = false;
+        return running_task;
+    }
+
+    static void
+    run_tasks(job & current_job)
+    {
+        bool const was_running_task = is_running_task();
+        is_running_task() = true;
+        for (int task = current_job.next_task++; task < current_job.number_of_tasks; task = current_job.next_task++)
+        {
+            try
+            {
+                current_job.call(current_job.function, task);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(current_job.exception_mutex);
+                if (!current_job.exception || task < current_job.exception_task)
+                {
+                    current_job.exception = std::current_exception();
+                    current_job.exception_task = task;
+                }
+            }
+        }
+        is_running_task() = was_running_task;
+    }
+
+    static void
+    rethrow(job & current_job)
+    {
+        if (current_job.exception)
+        {
+            std::rethrow_exception(current_job.exception);
+        }
+    }
+
+    void
+    work()
+    {
+        unsigned long long seen_generation = 0;
+        while (true)
+        {
+            job * current_job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                job_available_.wait(lock, [this, seen_generation]() { return stop_ || generation_ != seen_generation; });
+                if (stop_)
+                {
+                    return;
+                }
+                seen_generation = generation_;
+                // The job might be finished before this worker woke up
+                if (job_ == nullptr)
+                {
+                    continue;
+                }
+                current_job = job_;
+                ++workers_in_job_;
+            }
+
+            run_tasks(*current_job);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --workers_in_job_;
+            }
+            job_done_.notify_one();
+        }
+    }
+};
+
+// Split [begin, end) in contiguous subranges and call "function(first, last)"
+// for each one of them as a task of a job of the thread pool. The calling
+// thread processes subranges too and the function returns when all of them
+// are done. If "function" throws, the exception of the first subrange that
+// threw is rethrown from the calling thread once all of them are done
+template <typename function_type_tp>
+void
+parallel_for(int begin, int end, function_type_tp function, int number_of_threads = 0)
+{
+    int const size = end - begin;
+    if (size <= 0)
+    {
+        return;
+    }
+
+    if (number_of_threads <= 0)
+    {
+        number_of_threads = default_number_of_threads();
+    }
+    number_of_threads = std::min(number_of_threads, size);
+
+    if (number_of_threads == 1)
+    {
+        function(begin, end);
+        return;
+    }
+
+    auto run_subrange =
+        [begin, size, number_of_threads, &function](int i)
+        {
+            // Distribute the remainder among the first subranges
+            int const quotient = size / number_of_threads;
+            int const remainder = size % number_of_threads;
+            int const first = begin + i * quotient + std::min(i, remainder);
+            int const last = first + quotient + (i < remainder ? 1 : 0);
+            function(first, last);
+        };
+    thread_pool::instance().run(number_of_threads, run_subrange);
+}
+
+}
+
+#endif